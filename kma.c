@@ -58,8 +58,10 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -80,25 +82,52 @@ enum REQ_STATE
 
 typedef struct mem
 {
+  int id;
   int size;
   void* ptr;
-  void* value; // to check correctness
+  uint64_t key; // seeds the fill pattern, to check correctness
   enum REQ_STATE state;
 } mem_t;
 
+// first size of the live table, which doubles whenever it is half full
+#define LIVESLOTS 1024
+
+// unaligned, aliasing word access for the fill/check kernels
+typedef uint64_t uword_t __attribute__((aligned(1), may_alias));
+
 /************Global Variables*********************************************/
 
-static int val = 0;
+// counts allocations, so that a reused request id gets a new pattern
+static uint64_t serial = 0;
+
+// bytes per sampled span, 0 to check every byte
+static int span = 0;
+
+// the live requests, an open-addressed hash table keyed by request id,
+// so the harness only needs memory for what is live at once
+static mem_t* live = NULL;
+static int liveSlots = 0;
+static int liveCount = 0;
 
 /************Function Prototypes******************************************/
-void allocate();
-void deallocate();
-void fill(char*, int);
-void check(char*, char*, int);
+void allocate(int, int);
+void deallocate(int);
+mem_t* findSlot(int);
+void growLive();
+void removeSlot(mem_t*);
+uint64_t patternKey(int);
+uint64_t patternWord(uint64_t, int);
+void fill(char*, int, uint64_t);
+void check(char*, int, uint64_t);
+void fillSpan(char*, int, int, uint64_t);
+int checkSpan(char*, int, int, uint64_t);
 void usage();
 void error(char*, char*);
 void pass();
 void fail();
+#ifdef KMA_STATS
+void printStats(char*, kma_stat_t*);
+#endif
 
 /************External Declaration*****************************************/
 
@@ -108,7 +137,7 @@ void fail();
 
 int anyMismatches = 0;
 
-int currentAllocBytes = 0;
+long long currentAllocBytes = 0;
 
 char *name = NULL;
 
@@ -126,13 +155,31 @@ main(int argc, char* argv[])
   printf("%s: Running in correctness mode\n", name);
 #endif
 
-  int n_req = 0, n_alloc=0, n_dealloc=0;
+  long long n_req = 0, n_alloc=0, n_dealloc=0;
   kma_page_stat_t* stat;
 
 #ifdef COMPETITION
   double ratioSum = 0.0;
   int ratioCount = 0;
 #endif
+
+  // waste summed over every step with live allocations, so that its
+  // average is weighted by how long the waste was held
+  long long wasteSum = 0, wasteCount = 0;
+#ifdef KMA_STATS
+  long long internalSum = 0, metaSum = 0;
+#endif
+
+#ifdef KMA_STATS
+  // engine statistics at the point of the highest page usage
+  kma_stat_t peakStats;
+  int peakPages = -1;
+#endif
+
+#ifdef KMA_THP
+  // highest huge page coverage page_stats() reported
+  long thpBytes = 0;
+#endif
   
 #ifndef COMPETITION
   FILE* allocTrace = fopen("kma_output.dat", "w");
@@ -143,28 +190,41 @@ main(int argc, char* argv[])
   fprintf(allocTrace, "0 0 0\n");
 #endif
 
-  if (argc != 2)
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1)
+    {
+      if (opt == 's' && atoi(optarg) > 0)
+	{
+	  span = atoi(optarg);
+	}
+      else
+	{
+	  usage();
+	}
+    }
+  
+  if (argc - optind != 1)
     {
       usage();
     }
   
-  FILE* f_test = fopen(argv[1], "r");
+  FILE* f_test = fopen(argv[optind], "r");
   if (f_test == NULL)
     {
-      error("unable to open input test file", argv[1]);
+      error("unable to open input test file", argv[optind]);
     }
   
-  // Get the number of requests in the trace file
-  // Allocate some memory...
-  int status = fscanf(f_test, "%d\n", &n_req);
+  // Get the number of requests in the trace file; the trace is
+  // streamed, so only the live requests are kept in memory
+  int status = fscanf(f_test, "%lld\n", &n_req);
   if(status != 1)
     error("Couldn't read number of requests at head of file", "");
   
-  mem_t* requests = malloc((n_req + 1)*sizeof(mem_t));
-  memset(requests, 0, (n_req + 1)*sizeof(mem_t));
+  growLive();
   
   char command[16];
-  int req_id, req_size, index = 1;
+  int req_id, req_size;
+  long long index = 1;
 
   // Parse the lines in the file, and call allocate or
   // deallocate accordingly.
@@ -178,7 +238,7 @@ main(int argc, char* argv[])
 
     assert(req_id >= 0 && req_id < n_req);
     
-    allocate(requests, req_id, req_size);
+    allocate(req_id, req_size);
     n_alloc++;
   }
       else if (strcmp(command, "FREE") == 0)
@@ -188,7 +248,7 @@ main(int argc, char* argv[])
     
     assert(req_id >= 0 && req_id < n_req);
     
-    deallocate(requests, req_id);
+    deallocate(req_id);
     n_dealloc++;
   }
       else
@@ -197,7 +257,30 @@ main(int argc, char* argv[])
   }
 
       stat = page_stats();
-      int totalBytes = stat->num_in_use * stat->page_size;
+      long long totalBytes = (long long) stat->num_in_use * stat->page_size;
+
+      if (n_alloc != n_dealloc)
+  {
+    wasteSum += totalBytes - currentAllocBytes;
+#ifdef KMA_STATS
+    internalSum += gStats.slack_bytes;
+    metaSum += gStats.meta_bytes;
+#endif
+    wasteCount += 1;
+  }
+
+#ifdef KMA_STATS
+      if (stat->num_in_use > peakPages)
+  {
+    peakPages = stat->num_in_use;
+    memcpy(&peakStats, kma_stats(), sizeof(kma_stat_t));
+  }
+#endif
+
+#ifdef KMA_THP
+      if (stat->thp_bytes > thpBytes)
+  thpBytes = stat->thp_bytes;
+#endif
 
       
 #ifdef COMPETITION
@@ -205,14 +288,14 @@ main(int argc, char* argv[])
   {
     // We can calculate the ratio of wasted to used memory here.
 
-    int wastedBytes = totalBytes - currentAllocBytes;
+    long long wastedBytes = totalBytes - currentAllocBytes;
     ratioSum += ((double) wastedBytes) / currentAllocBytes;
     ratioCount += 1;
   }
 #endif
 
 #ifndef COMPETITION
-      fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
+      fprintf(allocTrace, "%lld %lld %lld\n", index, currentAllocBytes, totalBytes);
 #endif
       
       index += 1;
@@ -222,11 +305,44 @@ main(int argc, char* argv[])
   fclose(allocTrace);
 #endif
   
+#ifdef KMA_PERCPU
+  kma_flush();
+#endif
   
   stat = page_stats();
   
   printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
    stat->num_requested, stat->num_freed, stat->num_in_use); 
+
+  if (wasteCount > 0)
+    {
+      printf("Average waste over %lld steps: %lld bytes\n",
+	     wasteCount, wasteSum / wasteCount);
+#ifdef KMA_STATS
+      // whatever is neither rounding nor bookkeeping is free but unused
+      printf("  internal (size class rounding): %lld bytes (%.1f%%)\n",
+	     internalSum / wasteCount, 100.0 * internalSum / wasteSum);
+      printf("  external (free but unused):     %lld bytes (%.1f%%)\n",
+	     (wasteSum - internalSum - metaSum) / wasteCount,
+	     100.0 * (wasteSum - internalSum - metaSum) / wasteSum);
+      printf("  metadata:                       %lld bytes (%.1f%%)\n",
+	     metaSum / wasteCount, 100.0 * metaSum / wasteSum);
+#endif
+    }
+
+#ifdef KMA_STATS
+  printStats("at peak page usage", &peakStats);
+  printStats("at end of trace", kma_stats());
+#endif
+
+#ifdef KMA_PURGE
+  printf("Free pages purged: %d\n", stat->num_purged);
+#endif
+  
+#ifdef KMA_THP
+  printf("Pool backed by huge pages: %ld kB of %d kB at peak\n",
+   thpBytes / 1024, MAXPAGES * stat->page_size / 1024);
+#endif
   
   if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
     {
@@ -246,6 +362,31 @@ main(int argc, char* argv[])
   return 0;
 }
 
+#ifdef KMA_STATS
+void
+printStats(char* title, kma_stat_t* stats)
+{
+  int i;
+  
+  printf("Engine statistics %s:\n", title);
+  printf("  %8s %10s %10s %12s\n", "class", "live", "free", "allocs");
+  for (i = 0; i < stats->num_classes; i++)
+    {
+      kma_class_stat_t* c = &stats->classes[i];
+      
+      if (c->allocs == 0 && c->free == 0)
+	{
+	  continue;
+	}
+      printf("  %8d %10d %10d %12ld\n", c->size, c->live, c->free, c->allocs);
+    }
+  printf("  large runs live: %d\n", stats->large_live);
+  printf("  splits/merges: %ld/%ld\n", stats->splits, stats->merges);
+  printf("  page refills/releases: %ld/%ld\n", stats->refills, stats->releases);
+  printf("  metadata/slack bytes: %ld/%ld\n", stats->meta_bytes, stats->slack_bytes);
+}
+#endif
+
 void
 fail()
 {
@@ -262,7 +403,9 @@ pass()
 
 void
 usage() {
-  printf("Usage: %s traceFile\n", name);
+  printf("Usage: %s [-s span] traceFile\n", name);
+  printf("  -s span: only check the first, the last and one random span\n"
+	 "           of that many bytes of every allocation\n");
   exit(0);
 }
 
@@ -273,53 +416,52 @@ error(char* message, char* arg ) {
 }
 
 void
-allocate(mem_t* requests, int req_id, int req_size)
+allocate(int req_id, int req_size)
 {
-  mem_t* new = &requests[req_id];
+  if (2 * (liveCount + 1) > liveSlots)
+    {
+      growLive();
+    }
+  
+  mem_t* new = findSlot(req_id);
   
   assert(new->state == FREE);
   
+  new->id = req_id;
   new->size = req_size;
   new->ptr = kma_malloc(new->size);
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
-    {
-      error("got NULL from kma_malloc for alloc'able request", "");
-    }
-  
+  // Requests larger than a page are served from page runs, so
+  // every request has to succeed
   if (new->ptr == NULL)
     {
-      return;
+      error("got NULL from kma_malloc for alloc'able request", "");
     }
 
   currentAllocBytes += req_size;
   
 #ifndef COMPETITION
-  // Only run the actual memory accesses/copies/checks if we're
-  // testing for correctness.
+  // Only run the actual memory accesses/checks if we're testing for
+  // correctness. The pattern is regenerated from the key when checking,
+  // so no copy of the buffer is kept.
   
-  new->value = malloc(new->size);
-  assert(new->value != NULL);
+  new->key = patternKey(req_id);
   
   // initialize memory
-  fill((char*)new->ptr, new->size);
-  
-  // copy the value for further reference
-  bcopy(new->ptr, new->value, new->size);
+  fill((char*)new->ptr, new->size, new->key);
   
-  check((char*)new->ptr, (char*)new->value, new->size);
+  check((char*)new->ptr, new->size, new->key);
   
 #endif
 
   new->state = USED;
+  liveCount++;
 }
 
 void
-deallocate(mem_t* requests, int req_id)
+deallocate(int req_id)
 {
-  mem_t* cur = &requests[req_id];
+  mem_t* cur = findSlot(req_id);
   
   assert(cur->state == USED);
   assert(cur->size > 0);
@@ -328,42 +470,220 @@ deallocate(mem_t* requests, int req_id)
   // Only run the memory checks if we're testing for correctness.
 
   // check memory
-  check((char*)cur->ptr, (char*)cur->value, cur->size);
-
-  // free memory
-  free(cur->value);
+  check((char*)cur->ptr, cur->size, cur->key);
 #endif
 
   kma_free(cur->ptr, cur->size);
 
   currentAllocBytes -= cur->size;
   
-  cur->state = FREE;
+  removeSlot(cur);
+  liveCount--;
 }
 
+// the slot holding req_id, or the free slot where it would go
+mem_t*
+findSlot(int req_id)
+{
+  int i = (int) (((uint64_t) req_id * 0x9e3779b97f4a7c15ULL) >> 32) & (liveSlots - 1);
+  
+  while (live[i].state == USED && live[i].id != req_id)
+    {
+      i = (i + 1) & (liveSlots - 1);
+    }
+  return &live[i];
+}
+
+// double the live table (or create it) and rehash the live requests
 void
-fill(char* ptr, int size)
+growLive()
 {
-  int i;
+  mem_t* old = live;
+  int i, oldSlots = liveSlots;
+  
+  liveSlots = oldSlots ? 2 * oldSlots : LIVESLOTS;
+  live = calloc(liveSlots, sizeof(mem_t));
+  if (live == NULL)
+    {
+      error("unable to grow the live request table", "");
+    }
   
-  for (i = 0; i < size; i++)
+  for (i = 0; i < oldSlots; i++)
     {
-      ptr[i] = (char) val++;
+      if (old[i].state == USED)
+	{
+	  *findSlot(old[i].id) = old[i];
+	}
     }
+  free(old);
 }
 
+// empty a slot, moving later entries of its probe run back so that
+// lookups never stop early at a hole
 void
-check(char* lhs, char* rhs, int size)
+removeSlot(mem_t* slot)
 {
-  int i;
+  int hole = slot - live, i = hole, home;
   
-  for (i = 0; i < size; i++)
+  live[hole].state = FREE;
+  for (;;)
     {
-      if (lhs[i] != rhs[i])
-  {
-    fprintf(stderr, "memory mismatch at position %d (%3d!=%3d)\n", 
-      i, lhs[i], rhs[i]);
-    anyMismatches = 1;
-  }
+      i = (i + 1) & (liveSlots - 1);
+      if (live[i].state == FREE)
+	{
+	  return;
+	}
+      home = (int) (((uint64_t) live[i].id * 0x9e3779b97f4a7c15ULL) >> 32) & (liveSlots - 1);
+      // move it unless its home lies cyclically in (hole, i]
+      if ((i > hole && (home <= hole || home > i))
+	  || (i < hole && home <= hole && home > i))
+	{
+	  live[hole] = live[i];
+	  live[i].state = FREE;
+	  hole = i;
+	}
+    }
+}
+
+// a distinct pattern seed for every allocation (splitmix64 finalizer)
+uint64_t
+patternKey(int req_id)
+{
+  uint64_t z = ((uint64_t) req_id << 32) + serial++;
+  
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// the pattern of the k-th 8 byte word of an allocation
+uint64_t
+patternWord(uint64_t key, int k)
+{
+  return key + (uint64_t) k * 0x9e3779b97f4a7c15ULL;
+}
+
+// fill (or check) the whole buffer, or with spans set only its head, its
+// tail and one span in between picked by the key
+void
+fill(char* ptr, int size, uint64_t key)
+{
+  if (span == 0 || size <= 3 * span)
+    {
+      fillSpan(ptr, 0, size, key);
+      return;
+    }
+  
+  int middle = span + key % (size - 3 * span + 1);
+  fillSpan(ptr, 0, span, key);
+  fillSpan(ptr, middle, middle + span, key);
+  fillSpan(ptr, size - span, size, key);
+}
+
+void
+check(char* ptr, int size, uint64_t key)
+{
+  int bad;
+  
+  if (span == 0 || size <= 3 * span)
+    {
+      bad = checkSpan(ptr, 0, size, key);
+    }
+  else
+    {
+      int middle = span + key % (size - 3 * span + 1);
+      bad = checkSpan(ptr, 0, span, key)
+	+ checkSpan(ptr, middle, middle + span, key)
+	+ checkSpan(ptr, size - span, size, key);
+    }
+  
+  if (bad)
+    {
+      anyMismatches = 1;
+    }
+}
+
+// write the pattern to bytes [from, to) of the buffer; whole words go
+// through a loop the compiler vectorizes, the ragged ends byte by byte
+void
+fillSpan(char* ptr, int from, int to, uint64_t key)
+{
+  int i = from;
+  uint64_t w;
+  
+  for (; i < to && i % 8 != 0; i++)
+    {
+      w = patternWord(key, i / 8);
+      ptr[i] = ((char*) &w)[i % 8];
+    }
+  
+  int k, words = (to - i) / 8, first = i / 8;
+  uword_t* p = (uword_t*) (ptr + i);
+  for (k = 0; k < words; k++)
+    {
+      p[k] = patternWord(key, first + k);
+    }
+  
+  for (i += 8 * words; i < to; i++)
+    {
+      w = patternWord(key, i / 8);
+      ptr[i] = ((char*) &w)[i % 8];
     }
-}
\ No newline at end of file
+}
+
+// compare bytes [from, to) against the pattern, report the first
+// mismatch and return the number of mismatched bytes
+int
+checkSpan(char* ptr, int from, int to, uint64_t key)
+{
+  int i, k, words, first, bad = 0;
+  uint64_t w, diff = 0;
+  uword_t* p;
+  
+  // fast path: OR together the differences of the aligned words
+  i = (from + 7) & ~7;
+  if (i < to)
+    {
+      words = (to - i) / 8;
+      first = i / 8;
+      p = (uword_t*) (ptr + i);
+      for (k = 0; k < words; k++)
+	{
+	  diff |= p[k] ^ patternWord(key, first + k);
+	}
+      if (diff == 0)
+	{
+	  // only the ragged ends are left
+	  for (k = from; k < to && k < i; k++)
+	    {
+	      w = patternWord(key, k / 8);
+	      diff |= ptr[k] != ((char*) &w)[k % 8];
+	    }
+	  for (k = i + 8 * words; k < to; k++)
+	    {
+	      w = patternWord(key, k / 8);
+	      diff |= ptr[k] != ((char*) &w)[k % 8];
+	    }
+	  if (diff == 0)
+	    {
+	      return 0;
+	    }
+	}
+    }
+  
+  // slow path: find the mismatched bytes
+  for (i = from; i < to; i++)
+    {
+      w = patternWord(key, i / 8);
+      if (ptr[i] != ((char*) &w)[i % 8])
+	{
+	  if (bad == 0)
+	    {
+	      fprintf(stderr, "memory mismatch at position %d (%3d!=%3d)\n",
+		      i, ptr[i], ((char*) &w)[i % 8]);
+	    }
+	  bad++;
+	}
+    }
+  return bad;
+}
@@ -74,7 +74,50 @@
 
 typedef int kma_size_t;
 
+/*  With KMA_PERCPU the engine's entry points become engine_malloc and
+ *  engine_free, and kma_percpu.c puts its per-CPU caches in front.
+ */
+#if defined(KMA_PERCPU) && defined(__KMA_IMPL__)
+#define kma_malloc engine_malloc
+#define kma_free engine_free
+#endif
+
+/*  Engine statistics are only collected when compiled with KMA_STATS;
+ *  otherwise STAT() statements compile to nothing.
+ */
+#ifdef KMA_STATS
+#define STAT(x) (x)
+#else
+#define STAT(x)
+#endif
+
+#define KMA_NUMCLASSES 24
+
+typedef struct
+{
+  int size;          // buffer size of the class, 0 if variable
+  int live;          // buffers currently handed out
+  int free;          // buffers on the free list
+  long allocs;       // requests served from this class
+} kma_class_stat_t;
+
+typedef struct
+{
+  int num_classes;
+  kma_class_stat_t classes[KMA_NUMCLASSES];
+  int large_live;    // page runs handed out by get_large()
+  long splits;       // blocks split (buddy) or carved (resource map)
+  long merges;       // blocks coalesced with a free neighbour
+  long refills;      // data pages or runs taken from the page allocator
+  long releases;     // data pages or runs given back
+  long meta_bytes;   // bookkeeping pages and per-buffer headers
+  long slack_bytes;  // buffer size minus requested size of live buffers
+} kma_stat_t;
+
 /************Global Variables*********************************************/
+#ifdef KMA_STATS
+EXTERN kma_stat_t gStats;
+#endif
 
 /************Function Prototypes******************************************/
 
@@ -100,6 +143,30 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+#ifdef KMA_PERCPU
+/***********************************************************************
+ *  Title: Empties the per-CPU caches
+ * ---------------------------------------------------------------------
+ *    Purpose: Gives every cached buffer back to the engine; no other
+ *             thread may allocate or free meanwhile
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+void kma_flush();
+#endif
+
+#ifdef KMA_STATS
+/***********************************************************************
+ *  Title: Allocator statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the per size class and engine wide statistics;
+ *             free list lengths are counted when called
+ *    Input: none
+ *    Output: the statistics in a static buffer
+ ***********************************************************************/
+EXTERN kma_stat_t* kma_stats();
+#endif
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
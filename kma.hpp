@@ -0,0 +1,321 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: C++ allocators assembled from size class, page and cache
+ *              policies on top of the engines
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *    kma::allocator<SizeClassPolicy, PagePolicy, CachePolicy>
+ *
+ *  SizeClassPolicy maps a request to a class: kma::classes, the classes
+ *  of kma_classes.h, or kma::pow2_classes<MIN, MAX>. PagePolicy gets and
+ *  returns the buffers of a class: kma::engine_pages from the engine
+ *  linked in (kma_malloc, kma_free), or kma::run_pages, runs of whole
+ *  pages (get_large, free_large). CachePolicy keeps freed buffers of
+ *  each class in front of it: kma::stack_cache<BYTES>, a list per class
+ *  of at most BYTES, or kma::no_cache.
+ *
+ *  The class tables are constexpr, so allocate<SIZE>() and
+ *  deallocate<SIZE>() take the class as a constant and inline to a pop
+ *  or push of its list; allocate(size) looks the class up in the same
+ *  table at run time. Requests beyond the largest class go to the
+ *  PagePolicy as they are. Like the engines, not thread safe.
+ *
+ *  kma::resource<ALLOCATOR> puts std::pmr containers on an engine,
+ *  directly (kma::direct) or through a kma::allocator.
+ ***************************************************************************/
+
+#ifndef __KMA_HPP__
+#define __KMA_HPP__
+
+/************System include***********************************************/
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+/************Private include**********************************************/
+extern "C" {
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_classes.h"
+}
+// kma.h defines it for C
+#undef bool
+
+namespace kma {
+
+/************Size class policies******************************************/
+
+//the classes of kma_classes.h, the ones kma_p2fl and kma_mck2 use
+struct classes {
+    static constexpr int kCount = KMA_CLASSES;
+    static constexpr int kSizes[KMA_CLASSES] = KMA_CLASS_SIZES;
+    static constexpr unsigned char kClassOf[PAGESIZE / KMA_CLASSGRAIN + 1] = KMA_CLASS_OF;
+    static_assert(kCount >= 2, "kma_classes.h needs a class below the page sized one");
+
+    //the last class is the whole page, which an engine serves with its per-buffer header
+    //from a run of two, so larger requests go to the engine as they are
+    static constexpr std::size_t max_size() {
+        return kSizes[kCount - 2];
+    }
+
+    static constexpr int index(std::size_t size) {
+        return kClassOf[(size + KMA_CLASSGRAIN - 1) / KMA_CLASSGRAIN];
+    }
+
+    static constexpr std::size_t size(int ndx) {
+        return kSizes[ndx];
+    }
+};
+
+//powers of two from MIN to MAX bytes, the blocks of kma_bud
+template <std::size_t MIN = 32, std::size_t MAX = PAGESIZE / 2>
+struct pow2_classes {
+    static_assert(MIN >= sizeof(void *) && (MIN & (MIN - 1)) == 0 && (MAX & (MAX - 1)) == 0 && MIN <= MAX,
+                  "class sizes must be powers of two that hold a list pointer");
+
+    static constexpr int kCount = __builtin_ctzl(MAX / MIN) + 1;
+
+    static constexpr std::size_t max_size() {
+        return MAX;
+    }
+
+    static constexpr int index(std::size_t size) {
+        return size <= MIN ? 0 : 8 * sizeof(long) - __builtin_clzl((size - 1) / MIN);
+    }
+
+    static constexpr std::size_t size(int ndx) {
+        return MIN << ndx;
+    }
+};
+
+/************Page policies************************************************/
+
+//buffers from the engine linked in
+struct engine_pages {
+    static void *get(std::size_t size) {
+        return kma_malloc((kma_size_t) size);
+    }
+
+    static void put(void *ptr, std::size_t size) {
+        kma_free(ptr, (kma_size_t) size);
+    }
+};
+
+//every buffer a run of whole pages from the top of the pool
+struct run_pages {
+    static void *get(std::size_t size) {
+        return get_large((int) size);
+    }
+
+    static void put(void *ptr, std::size_t size) {
+        free_large(ptr, (int) size);
+    }
+};
+
+/************Cache policies***********************************************/
+
+//every call goes to the PagePolicy
+struct no_cache {
+    template <int COUNT>
+    struct lists {
+        void *pop(int) {
+            return nullptr;
+        }
+
+        bool push(int, void *, std::size_t) {
+            return false;
+        }
+
+        template <class PUT>
+        void drain(PUT) {
+        }
+    };
+};
+
+//a LIFO list of freed buffers per class, at most BYTES of each, like the
+//per-CPU stacks of kma_percpu.c; the lists are linked through the buffers
+template <std::size_t BYTES = 32 * 1024>
+struct stack_cache {
+    template <int COUNT>
+    struct lists {
+        void *head[COUNT] = {};
+        std::size_t count[COUNT] = {};
+
+        void *pop(int ndx) {
+            void *buffer = head[ndx];
+            if (buffer != nullptr) {
+                head[ndx] = *(void **) buffer;
+                count[ndx]--;
+            }
+            return buffer;
+        }
+
+        bool push(int ndx, void *buffer, std::size_t size) {
+            if (count[ndx] >= BYTES / size) return false;
+            *(void **) buffer = head[ndx];
+            head[ndx] = buffer;
+            count[ndx]++;
+            return true;
+        }
+
+        //hand every cached buffer to put(buffer, ndx)
+        template <class PUT>
+        void drain(PUT put) {
+            int ndx;
+            for (ndx = 0; ndx < COUNT; ndx++) {
+                void *buffer;
+                while ((buffer = pop(ndx)) != nullptr) {
+                    put(buffer, ndx);
+                }
+            }
+        }
+    };
+};
+
+/************Allocator****************************************************/
+
+template <class SizeClassPolicy = classes, class PagePolicy = engine_pages, class CachePolicy = stack_cache<>>
+class allocator {
+public:
+    allocator() = default;
+    allocator(const allocator &) = delete;
+    allocator &operator=(const allocator &) = delete;
+
+    ~allocator() {
+        release();
+    }
+
+    //SIZE known at compile time: the class is a constant, the fast path a list pop
+    template <std::size_t SIZE>
+    void *allocate() {
+        if constexpr (SIZE > SizeClassPolicy::max_size()) {
+            return get(SIZE);
+        } else {
+            constexpr int ndx = SizeClassPolicy::index(SIZE);
+            void *buffer = lists_.pop(ndx);
+            return buffer != nullptr ? buffer : get(SizeClassPolicy::size(ndx));
+        }
+    }
+
+    template <std::size_t SIZE>
+    void deallocate(void *ptr) {
+        if constexpr (SIZE > SizeClassPolicy::max_size()) {
+            PagePolicy::put(ptr, SIZE);
+        } else {
+            constexpr int ndx = SizeClassPolicy::index(SIZE);
+            constexpr std::size_t size = SizeClassPolicy::size(ndx);
+            if (!lists_.push(ndx, ptr, size)) PagePolicy::put(ptr, size);
+        }
+    }
+
+    void *allocate(std::size_t size) {
+        if (size > SizeClassPolicy::max_size()) return get(size);
+
+        int ndx = SizeClassPolicy::index(size);
+        void *buffer = lists_.pop(ndx);
+        return buffer != nullptr ? buffer : get(SizeClassPolicy::size(ndx));
+    }
+
+    void deallocate(void *ptr, std::size_t size) {
+        if (size > SizeClassPolicy::max_size()) {
+            PagePolicy::put(ptr, size);
+            return;
+        }
+        int ndx = SizeClassPolicy::index(size);
+        if (!lists_.push(ndx, ptr, SizeClassPolicy::size(ndx))) PagePolicy::put(ptr, SizeClassPolicy::size(ndx));
+    }
+
+    template <class T, class... ARGS>
+    T *create(ARGS &&... args) {
+        return new (allocate<sizeof(T)>()) T(std::forward<ARGS>(args)...);
+    }
+
+    template <class T>
+    void destroy(T *obj) {
+        obj->~T();
+        deallocate<sizeof(T)>(obj);
+    }
+
+    //give every cached buffer back to the PagePolicy
+    void release() {
+        lists_.drain([](void *buffer, int ndx) { PagePolicy::put(buffer, SizeClassPolicy::size(ndx)); });
+    }
+
+private:
+    //the slow path stays out of line, so the fast path inlines into the caller
+    __attribute__((noinline)) static void *get(std::size_t size) {
+        void *buffer = PagePolicy::get(size);
+        if (buffer == nullptr) throw std::bad_alloc();
+        return buffer;
+    }
+
+    typename CachePolicy::template lists<SizeClassPolicy::kCount> lists_;
+};
+
+/************Memory resource**********************************************/
+
+//the engine as it is: every call goes to kma_malloc and kma_free with the size asked for
+struct direct {
+    void *allocate(std::size_t size) {
+        void *buffer = engine_pages::get(size);
+        if (buffer == nullptr) throw std::bad_alloc();
+        return buffer;
+    }
+
+    void deallocate(void *ptr, std::size_t size) {
+        engine_pages::put(ptr, size);
+    }
+};
+
+//a std::pmr::memory_resource on ALLOCATOR (kma::direct or a kma::allocator);
+//do_deallocate gets the size back, which is all kma_free needs. Sizes are
+//rounded up to a multiple of 8, so every engine returns buffers aligned to
+//8; a larger alignment takes align more bytes, and the word before the
+//aligned buffer keeps the one the engine returned
+template <class ALLOCATOR = direct>
+class resource : public std::pmr::memory_resource {
+public:
+    ALLOCATOR &allocator() {
+        return alloc_;
+    }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        std::size_t size = round(bytes);
+        if (align <= sizeof(void *)) return alloc_.allocate(size);
+
+        void *base = alloc_.allocate(size + align);
+        std::uintptr_t buffer = ((std::uintptr_t) base + sizeof(void *) + align - 1) & ~(std::uintptr_t) (align - 1);
+        ((void **) buffer)[-1] = base;
+        return (void *) buffer;
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t align) override {
+        std::size_t size = round(bytes);
+        if (align <= sizeof(void *)) {
+            alloc_.deallocate(ptr, size);
+        } else {
+            alloc_.deallocate(((void **) ptr)[-1], size + align);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    static std::size_t round(std::size_t bytes) {
+        return bytes == 0 ? sizeof(void *) : (bytes + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    }
+
+    ALLOCATOR alloc_;
+};
+
+} // namespace kma
+
+#endif /* __KMA_HPP__ */
@@ -0,0 +1,411 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Worst case trace search for the kernel memory allocator
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: jlx979, rgp633
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *  Searches, for the engine it is linked with, the parameters of a few
+ *  trace families that attack known weak spots:
+ *
+ *    pingpong    one request at a time next to a long lived anchor, so
+ *                every request splits (and every free merges) a page
+ *    interleave  many buffers with every t-th kept, which leaves a long
+ *                list of holes, then requests that fit none of them
+ *    emptypages  a half empty size class, then rounds that take a fresh
+ *                page and empty it again
+ *
+ *  Every candidate is replayed in process. A random start is improved by
+ *  hill climbing on ns/op (-m latency) or on the average ratio of wasted
+ *  to used memory (-m waste). The worst trace of every family is written
+ *  to <dir>/adv_<engine>_<family>.trace in the harness format.
+ *
+ *  usage: kma_<engine>_adversary [-m latency|waste] [-n iterations] [-o dir]
+ ***************************************************************************/
+
+#define __KMA_TEST_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#if defined(KMA_DUMMY)
+#define ENGINE "dummy"
+#elif defined(KMA_RM)
+#define ENGINE "rm"
+#elif defined(KMA_P2FL)
+#define ENGINE "p2fl"
+#elif defined(KMA_MCK2)
+#define ENGINE "mck2"
+#elif defined(KMA_BUD)
+#define ENGINE "bud"
+#elif defined(KMA_LZBUD)
+#define ENGINE "lzbud"
+#elif defined(KMA_HYBRID)
+#define ENGINE "hybrid"
+#else
+#define ENGINE "unknown"
+#endif
+
+// length of a candidate trace
+#define MAXOPS 20000
+
+// live bytes a candidate may hold, so that every engine stays inside
+// the page pool and its page tables
+#define LIVECAP (4 * 1024 * 1024)
+
+#define NUMPARAMS 4
+
+typedef struct
+{
+  bool request;
+  int id;
+  int size;
+} op_t;
+
+typedef struct
+{
+  char* name;
+  int lo[NUMPARAMS];
+  int hi[NUMPARAMS];
+  void (*generate)(int*);
+} family_t;
+
+/************Global Variables*********************************************/
+
+static op_t gOps[MAXOPS];
+static int gNumOps;
+static int gNextId;
+
+static void* gPtrs[MAXOPS];
+static int gSizes[MAXOPS];
+
+static bool gLatency = TRUE;
+
+static unsigned int gSeed = 2463534242U;
+
+/************Function Prototypes******************************************/
+void genPingpong(int*);
+void genInterleave(int*);
+void genEmptypages(int*);
+int request(int);
+void release(int);
+double replay();
+double score(int*, family_t*);
+void search(family_t*, int, char*);
+void writeTrace(char*);
+double now();
+unsigned int rnd();
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+//                                           lo                   hi
+static family_t kFamilies[] = {
+  { "pingpong",   { 16, 16, 0, 0 },          { 8192, 8192, 0, 0 },          genPingpong },
+  { "interleave", { 64, 16, 2, 16 },         { 4096, 2048, 16, 8192 },      genInterleave },
+  { "emptypages", { 64, 16, 1, 0 },          { 4096, 4096, 1024, 0 },       genEmptypages },
+};
+
+int
+main(int argc, char* argv[])
+{
+  int i, opt, iterations = 50;
+  char* dir = ".";
+
+  while ((opt = getopt(argc, argv, "m:n:o:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'm':
+	  if (strcmp(optarg, "latency") == 0)
+	    gLatency = TRUE;
+	  else if (strcmp(optarg, "waste") == 0)
+	    gLatency = FALSE;
+	  else
+	    error("unknown metric", optarg);
+	  break;
+	case 'n':
+	  iterations = atoi(optarg);
+	  break;
+	case 'o':
+	  dir = optarg;
+	  break;
+	default:
+	  printf("Usage: %s [-m latency|waste] [-n iterations] [-o dir]\n", argv[0]);
+	  exit(0);
+	}
+    }
+
+  printf("%-6s %-11s %26s %12s\n", "engine", "family", "parameters",
+	 gLatency ? "ns/op" : "waste ratio");
+
+  for (i = 0; i < sizeof(kFamilies) / sizeof(family_t); i++)
+    {
+      search(&kFamilies[i], iterations, dir);
+    }
+
+  return 0;
+}
+
+// one anchor of size p[0], then rounds of a single request of size p[1]
+void
+genPingpong(int* p)
+{
+  int anchor = request(p[0]);
+
+  while (gNumOps + 3 <= MAXOPS)
+    {
+      release(request(p[1]));
+    }
+  release(anchor);
+}
+
+// p[0] buffers of size p[1], free all but every p[2]-th, then rounds of
+// a request of size p[3]
+void
+genInterleave(int* p)
+{
+  int i, n = p[0], first = gNextId;
+
+  if (n * p[1] > LIVECAP)
+    n = LIVECAP / p[1];
+
+  for (i = 0; i < n; i++)
+    request(p[1]);
+  for (i = 0; i < n; i++)
+    if (i % p[2] != 0)
+      release(first + i);
+  while (gNumOps + 2 + n / p[2] + 1 <= MAXOPS)
+    {
+      release(request(p[3]));
+    }
+  for (i = 0; i < n; i += p[2])
+    release(first + i);
+}
+
+// p[0] buffers of size p[1] with every other one freed, then rounds that
+// request p[2] more of the same size and free them again
+void
+genEmptypages(int* p)
+{
+  int i, k, n = p[0], first = gNextId, round;
+
+  if (n * p[1] > LIVECAP / 2)
+    n = LIVECAP / 2 / p[1];
+
+  for (i = 0; i < n; i++)
+    request(p[1]);
+  for (i = 1; i < n; i += 2)
+    release(first + i);
+  while (gNumOps + 2 * p[2] + (n + 1) / 2 <= MAXOPS)
+    {
+      round = gNextId;
+      for (k = 0; k < p[2]; k++)
+	request(p[1]);
+      for (k = p[2] - 1; k >= 0; k--)
+	release(round + k);
+    }
+  for (i = 0; i < n; i += 2)
+    release(first + i);
+}
+
+int
+request(int size)
+{
+  assert(gNumOps < MAXOPS);
+  gOps[gNumOps].request = TRUE;
+  gOps[gNumOps].id = gNextId;
+  gOps[gNumOps].size = size;
+  gSizes[gNextId] = size;
+  gNumOps++;
+  return gNextId++;
+}
+
+void
+release(int id)
+{
+  assert(gNumOps < MAXOPS);
+  gOps[gNumOps].request = FALSE;
+  gOps[gNumOps].id = id;
+  gOps[gNumOps].size = gSizes[id];
+  gNumOps++;
+}
+
+// run the trace once; returns ns/op or the average waste ratio, like
+// the competition mode of the harness
+double
+replay()
+{
+  int i;
+  long long live = 0;
+  double ratioSum = 0, start = now();
+
+  for (i = 0; i < gNumOps; i++)
+    {
+      op_t* op = &gOps[i];
+
+      if (op->request)
+	{
+	  gPtrs[op->id] = kma_malloc(op->size);
+	  if (gPtrs[op->id] == NULL)
+	    error("got NULL from kma_malloc", "");
+	  live += op->size;
+	}
+      else
+	{
+	  kma_free(gPtrs[op->id], op->size);
+	  live -= op->size;
+	}
+
+      if (!gLatency && live > 0)
+	{
+	  ratioSum += (double) (page_stats()->num_in_use * PAGESIZE - live) / live;
+	}
+    }
+
+  if (page_stats()->num_in_use != 0)
+    error("not all pages freed", "");
+
+  return gLatency ? (now() - start) / gNumOps : ratioSum / gNumOps;
+}
+
+// generate the trace for p and measure it; latency takes the best of
+// three runs so that a stray interrupt does not win the search
+double
+score(int* p, family_t* family)
+{
+  int i;
+  double best = 0;
+
+  gNumOps = 0;
+  gNextId = 0;
+  family->generate(p);
+
+  if (!gLatency)
+    return replay();
+
+  for (i = 0; i < 3; i++)
+    {
+      double s = replay();
+      if (i == 0 || s < best)
+	best = s;
+    }
+  return best;
+}
+
+void
+search(family_t* family, int iterations, char* dir)
+{
+  int i, k, p[NUMPARAMS], best[NUMPARAMS];
+  double s, bestScore;
+  char file[1024];
+
+  for (k = 0; k < NUMPARAMS; k++)
+    best[k] = family->lo[k] + rnd() % (family->hi[k] - family->lo[k] + 1);
+  bestScore = score(best, family);
+
+  for (i = 0; i < iterations; i++)
+    {
+      memcpy(p, best, sizeof(p));
+
+      // scale one parameter by 1/2..2, or every tenth step jump anywhere
+      k = rnd() % NUMPARAMS;
+      if (family->lo[k] == family->hi[k])
+	continue;
+      if (rnd() % 10 == 0)
+	p[k] = family->lo[k] + rnd() % (family->hi[k] - family->lo[k] + 1);
+      else
+	p[k] = p[k] * (512 + rnd() % 1537) / 1024;
+      if (p[k] < family->lo[k])
+	p[k] = family->lo[k];
+      if (p[k] > family->hi[k])
+	p[k] = family->hi[k];
+
+      s = score(p, family);
+      if (s > bestScore)
+	{
+	  bestScore = s;
+	  memcpy(best, p, sizeof(p));
+	}
+    }
+
+  printf("%-6s %-11s %5d %5d %5d %5d %17.2f\n", ENGINE, family->name,
+	 best[0], best[1], best[2], best[3], bestScore);
+
+  gNumOps = 0;
+  gNextId = 0;
+  family->generate(best);
+  snprintf(file, sizeof(file), "%s/adv_%s_%s.trace", dir, ENGINE, family->name);
+  writeTrace(file);
+}
+
+void
+writeTrace(char* file)
+{
+  int i;
+  FILE* f = fopen(file, "w");
+
+  if (f == NULL)
+    error("unable to open trace file", file);
+
+  fprintf(f, "%d\n", gNumOps);
+  for (i = 0; i < gNumOps; i++)
+    {
+      if (gOps[i].request)
+	fprintf(f, "REQUEST %d %d\n", gOps[i].id, gOps[i].size);
+      else
+	fprintf(f, "FREE %d\n", gOps[i].id);
+    }
+  fclose(f);
+}
+
+double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// xorshift, so that a search is repeatable
+unsigned int
+rnd()
+{
+  gSeed ^= gSeed << 13;
+  gSeed ^= gSeed >> 17;
+  gSeed ^= gSeed << 5;
+  return gSeed;
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
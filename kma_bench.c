@@ -0,0 +1,296 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Microbenchmarks for the kernel memory allocator engines
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: jlx979, rgp633
+ 
+ ***************************************************************************/
+
+#define __KMA_TEST_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#if defined(KMA_DUMMY)
+#define ENGINE "KMA_DUMMY"
+#elif defined(KMA_RM)
+#define ENGINE "KMA_RM"
+#elif defined(KMA_P2FL)
+#define ENGINE "KMA_P2FL"
+#elif defined(KMA_MCK2)
+#define ENGINE "KMA_MCK2"
+#elif defined(KMA_BUD)
+#define ENGINE "KMA_BUD"
+#elif defined(KMA_LZBUD)
+#define ENGINE "KMA_LZBUD"
+#elif defined(KMA_HYBRID)
+#define ENGINE "KMA_HYBRID"
+#else
+#define ENGINE "unknown"
+#endif
+
+// operations (one kma_malloc or one kma_free) per measurement
+#define NUMOPS (1 << 20)
+
+// stop a measurement early once it has run this long (ns), so the slow
+// engines finish in reasonable time; ns/op uses the operations done
+#define BUDGET 1e9
+
+// objects alive at once in the LIFO/FIFO and refill patterns
+#define NUMOBJS 1024
+
+// skip sizes whose NUMOBJS buffers would not fit in a quarter of the page
+// pool (p2fl, for one, keeps its pages until it tears down)
+#define FITS(size) ((size) * NUMOBJS <= MAXPAGES / 4 * PAGESIZE)
+
+typedef struct
+{
+  void* ptr;
+  int size;
+} slot_t;
+
+/************Global Variables*********************************************/
+
+static const int kSizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048, 4096,
+			      8000, 16384, 65536 };
+
+static const int kWorkingSets[] = { 16, 256, 2048 };
+
+static slot_t gSlots[2048];
+
+static unsigned int gSeed = 2463534242U;
+
+/************Function Prototypes******************************************/
+double now();
+unsigned int rnd();
+void report(char*, int, double, int);
+void benchPairs(int);
+void benchOrder(int, bool);
+void benchRandom(int);
+void benchRefill(int);
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  int i;
+  void* anchor;
+  
+  printf("%-10s %-8s %8s %10s %6s\n", "engine", "pattern", "size", "ns/op", "pages");
+  
+  // keep one allocation pending so that the engines do not tear down
+  // their bookkeeping between iterations, like the trace harness does
+  anchor = kma_malloc(32);
+  
+  for (i = 0; i < sizeof(kSizes) / sizeof(int); i++)
+    {
+      benchPairs(kSizes[i]);
+    }
+  
+  for (i = 0; i < sizeof(kSizes) / sizeof(int); i++)
+    {
+      if (FITS(kSizes[i]))
+	{
+	  benchOrder(kSizes[i], TRUE);
+	  benchOrder(kSizes[i], FALSE);
+	}
+    }
+  
+  for (i = 0; i < sizeof(kWorkingSets) / sizeof(int); i++)
+    {
+      benchRandom(kWorkingSets[i]);
+    }
+  
+  kma_free(anchor, 32);
+  
+  // the refill pattern drains the engine to empty on purpose
+  for (i = 0; i < sizeof(kSizes) / sizeof(int); i++)
+    {
+      if (FITS(kSizes[i]))
+	{
+	  benchRefill(kSizes[i]);
+	}
+    }
+  
+  if (page_stats()->num_in_use != 0)
+    {
+      error("not all pages freed", "");
+    }
+  
+  return 0;
+}
+
+double
+now()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// xorshift, so that every engine sees the same sequence
+unsigned int
+rnd()
+{
+  gSeed ^= gSeed << 13;
+  gSeed ^= gSeed >> 17;
+  gSeed ^= gSeed << 5;
+  return gSeed;
+}
+
+void
+report(char* pattern, int size, double ns, int pages)
+{
+  printf("%-10s %-8s %8d %10.1f %6d\n", ENGINE, pattern, size, ns, pages);
+}
+
+// malloc immediately followed by free of the same size
+void
+benchPairs(int size)
+{
+  int i, j;
+  double start = now();
+  
+  for (i = 0; i < NUMOPS && now() - start < BUDGET; i += 2 * NUMOBJS)
+    {
+      for (j = 0; j < NUMOBJS; j++)
+	{
+	  void* ptr = kma_malloc(size);
+	  kma_free(ptr, size);
+	}
+    }
+  
+  report("pair", size, (now() - start) / i, page_stats()->num_in_use);
+}
+
+// allocate NUMOBJS buffers, then free them newest first (lifo) or
+// oldest first (fifo)
+void
+benchOrder(int size, bool lifo)
+{
+  int i, j, pages = 0;
+  double start = now();
+  
+  for (i = 0; i < NUMOPS && now() - start < BUDGET; i += 2 * NUMOBJS)
+    {
+      for (j = 0; j < NUMOBJS; j++)
+	{
+	  gSlots[j].ptr = kma_malloc(size);
+	}
+      pages = page_stats()->num_in_use;
+      for (j = 0; j < NUMOBJS; j++)
+	{
+	  int k = lifo ? NUMOBJS - 1 - j : j;
+	  kma_free(gSlots[k].ptr, size);
+	}
+    }
+  
+  report(lifo ? "lifo" : "fifo", size, (now() - start) / i, pages);
+}
+
+// a working set of ws slots; every operation picks a random slot and
+// frees it if used or allocates a random size into it if empty
+void
+benchRandom(int ws)
+{
+  int i, pages = 0;
+  double start;
+  
+  memset(gSlots, 0, sizeof(gSlots));
+  start = now();
+  
+  for (i = 0; i < NUMOPS; i++)
+    {
+      slot_t* slot = &gSlots[rnd() % ws];
+      
+      if (slot->ptr != NULL)
+	{
+	  kma_free(slot->ptr, slot->size);
+	  slot->ptr = NULL;
+	}
+      else
+	{
+	  slot->size = 16 + rnd() % 1009;
+	  slot->ptr = kma_malloc(slot->size);
+	}
+      
+      if ((i & 1023) == 0)
+	{
+	  if (page_stats()->num_in_use > pages)
+	    {
+	      pages = page_stats()->num_in_use;
+	    }
+	  if (now() - start > BUDGET)
+	    {
+	      i++;
+	      break;
+	    }
+	}
+    }
+  
+  report("random", ws, (now() - start) / i, pages);
+  
+  for (i = 0; i < ws; i++)
+    {
+      if (gSlots[i].ptr != NULL)
+	{
+	  kma_free(gSlots[i].ptr, gSlots[i].size);
+	}
+    }
+}
+
+// fill pages with NUMOBJS buffers and drain the engine to empty, so
+// every round refills pages (and bookkeeping) from the page allocator
+void
+benchRefill(int size)
+{
+  int i, j, pages = 0;
+  double start = now();
+  
+  for (i = 0; i < NUMOPS && now() - start < BUDGET; i += 2 * NUMOBJS)
+    {
+      for (j = 0; j < NUMOBJS; j++)
+	{
+	  gSlots[j].ptr = kma_malloc(size);
+	}
+      pages = page_stats()->num_in_use;
+      for (j = 0; j < NUMOBJS; j++)
+	{
+	  kma_free(gSlots[j].ptr, size);
+	}
+    }
+  
+  report("refill", size, (now() - start) / i, pages);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
@@ -42,11 +42,63 @@
 #define __KMA_IMPL__
 #define MAX(a, b) (((a)>(b))?(a):(b))
 #define MIN(a, b) (((a)<(b))?(a):(b))
-#define NUMPAGES 1500
+
+//buddy blocks live in superblocks, page runs of 32 << order bytes. A new
+//superblock is sized to the request but at least 32 << SUPERORDER (one page
+//by default), so blocks above a page coalesce across its pages. Requests up
+//to 32 << MAXORDER (1MB by default) are served with buddy semantics.
+#ifndef SUPERORDER
+#define SUPERORDER 8
+#endif
+#ifndef MAXORDER
+#define MAXORDER 15
+#endif
+#define MAXSIZE (32 << MAXORDER)
+#if MAXORDER > 15
+#error "superblock usage is counted in 16 bits of 32 byte blocks"
+#endif
+
+//free blocks in superblocks used below FULLNESS percent go to the tail of
+//their list, all others to the head, and requests are served from the head;
+//so live blocks pack into the fullest superblocks and the emptiest ones get
+//a chance to drain and go back (0 keeps the lists LIFO)
+#ifndef FULLNESS
+#define FULLNESS 75
+#endif
+
+//with TRIMTAIL a request keeps only the multiple of TRIMTAIL bytes (or of
+//its block, if smaller) it needs: its block is cut into power of two pieces
+//of that size, largest first, and the tail goes back to the end of the lists;
+//kma_free frees the same pieces, which merge with the tail again. Tails of
+//small pieces get taken by small requests and keep big blocks from merging,
+//hence pieces of 4KB and up by default (0 hands out whole blocks)
+#ifndef TRIMTAIL
+#define TRIMTAIL 4096
+#endif
+#define KEEPGRAIN(size) (TRIMTAIL ? MIN(size_from_index(get_list_index(size)), TRIMTAIL) \
+                                  : size_from_index(get_list_index(size)))
+#define KEEPSIZE(size) (((size) + KEEPGRAIN(size) - 1) & ~(KEEPGRAIN(size) - 1))
+
+//contiguous bookkeeping pages: used count, list heads, spare superblock,
+//number of pool pages covered, list tails, then per pool page (page_number)
+//the superblock pointer, a bitmap with one bit per 32 byte block and the
+//32 byte blocks in use of the superblock starting there. They start as one
+//page and grow (GROWPAGES), by copying, when a superblock lies beyond them.
+#define SPARE MAXORDER //freelist index of the cached free superblock
+#define CAPACITY (MAXORDER + 1) //freelist index of the number of pages covered
+#define TAIL (MAXORDER + 2) //freelist index of the list tails
+#define PAGETABLE (TAIL + MAXORDER) //freelist index of the page pointer table
+#define PAGEBYTES (sizeof(void *) + 8 * sizeof(int) + sizeof(short)) //bookkeeping per pool page
+#define BOOKPAGES(pages) ((int) ((sizeof(int) + PAGETABLE * sizeof(void *) \
+                                  + (pages) * PAGEBYTES + PAGESIZE - 1) / PAGESIZE))
+#define NUMPAGES(fl) ((long) ((void **) (fl))[CAPACITY])
+#define BITMAP(fl) ((int *) &((void **) (fl))[PAGETABLE + NUMPAGES(fl)])
+#define USAGE(fl) ((unsigned short *) &BITMAP(fl)[8 * NUMPAGES(fl)])
 
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -70,6 +122,8 @@ typedef struct free_list {
 /************Function Prototypes******************************************/
 void init();
 
+void grow(int);
+
 inline int get_list_index(kma_size_t);
 
 inline int size_from_index(int);
@@ -83,9 +137,23 @@ inline void unset_bitmask(void *);
 
 inline int check_bitmask(void *);
 
+inline void push_block(void *, int, int);
+
+inline void unlink_block(void *, int);
+
+inline unsigned short *superblock_usage(void *);
+
 inline void split_block(void *, int, int);
 
 inline void *merge_block(void *, int *);
+
+inline void trim_block(void *, int, int);
+
+inline void free_block(void *, int, unsigned short *);
+
+kma_page_t *get_superblock(int);
+
+void release_superblock(void *);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -93,30 +161,45 @@ inline void *merge_block(void *, int *);
 void init() {
     //fetch a page and initialize our bookkeeping
     root = get_page();
+    STAT(gStats.meta_bytes += root->size);
     *((int *) root->ptr) = 0; //track number of allocated buffers
-    kma_page_t **freelist = (root->ptr + sizeof(int));
-    freelist[0] = NULL; //size 32 list head
-    freelist[1] = NULL; //size 64 list head
-    freelist[2] = NULL; //size 128 list head
-    freelist[3] = NULL; //size 256 list head
-    freelist[4] = NULL; //size 512 list head
-    freelist[5] = NULL; //size 1024 list head
-    freelist[6] = NULL; //size 2048 list head
-    freelist[7] = NULL; //size 4096 list head
-    freelist[9] = 0; //this will be used as slack for lazy buddy
-
-    //additional pages for bookkeeping
-    freelist[10] = get_page();
-    freelist[11] = get_page();
-    freelist[12] = get_page();
-    freelist[13] = get_page();
-    freelist[14] = get_page();
-    freelist[15] = get_page();
+    void **freelist = (root->ptr + sizeof(int));
+    int i;
+    for (i = 0; i < MAXORDER; i++) {
+        freelist[i] = NULL; //size 32 << i list head
+        freelist[TAIL + i] = NULL;
+    }
+    freelist[SPARE] = NULL;
+    freelist[CAPACITY] = (void *) ((PAGESIZE - sizeof(int) - PAGETABLE * sizeof(void *)) / PAGEBYTES);
+
+    memset(&freelist[PAGETABLE], 0, NUMPAGES(freelist) * PAGEBYTES);
+}
+
+//move the bookkeeping to a run that covers pool pages up to pages - 1
+void grow(int pages) {
+    void **freelist = (root->ptr + sizeof(int));
+    long old = NUMPAGES(freelist);
+    long cap = MAX(GROWPAGES(old), pages);
+    int n = BOOKPAGES(cap);
+    cap = (n * PAGESIZE - sizeof(int) - PAGETABLE * sizeof(void *)) / PAGEBYTES;
+
+    kma_page_t *book = get_pages(n);
+    STAT(gStats.meta_bytes += book->size - root->size);
+    void **grown = (book->ptr + sizeof(int));
+    memcpy(book->ptr, root->ptr, sizeof(int) + (PAGETABLE + old) * sizeof(void *));
+    memset(&grown[PAGETABLE + old], 0, (cap - old) * sizeof(void *));
+    grown[CAPACITY] = (void *) cap;
+    memcpy(BITMAP(grown), BITMAP(freelist), 8 * old * sizeof(int));
+    memset(&BITMAP(grown)[8 * old], 0, 8 * (cap - old) * sizeof(int));
+    memcpy(USAGE(grown), USAGE(freelist), old * sizeof(short));
+    memset(&USAGE(grown)[old], 0, (cap - old) * sizeof(short));
+
+    free_pages(root);
+    root = book;
 }
 
 inline int get_page_index(void *ptr) {
-    kma_page_t **freelist = (root->ptr + sizeof(int));
-    return (BASEADDR(ptr) - freelist[15]->ptr) / 8192;
+    return page_number(ptr);
 }
 
 inline int get_list_index(kma_size_t size) {
@@ -129,172 +212,309 @@ inline int size_from_index(int ndx) {
 
 inline void *buddy_addr(void *orig, int size) {
     //assert(__builtin_parity(size) == 1); //ensure we use powers of 2
-    return (void *) (((int) orig) ^ size);
+    //superblocks are only page aligned, so take the buddy relative to its start
+    kma_page_t **freelist = (root->ptr + sizeof(int));
+    void *base = freelist[PAGETABLE + get_page_index(orig)]->ptr;
+    return base + ((orig - base) ^ size);
 }
 
 
 inline void set_bitmask(void *block) {
     int pg_ndx = get_page_index(block);
-    int pg_blk_num = (((int) block) & 8191) / 32;
+    int pg_blk_num = (((long) block) & (PAGESIZE - 1)) / 32;
     int index_offset = pg_blk_num / 32;
     int mask = 1 << (pg_blk_num % 32);
 
-    int *freelist = (root->ptr + sizeof(int));
-    freelist[10 + NUMPAGES + index_offset + (8 * pg_ndx)] |= mask;
+    int *bitmap = BITMAP(root->ptr + sizeof(int));
+    bitmap[index_offset + (8 * pg_ndx)] |= mask;
 }
 
 inline void unset_bitmask(void *block) {
     int pg_ndx = get_page_index(block);
-    int pg_blk_num = (((int) block) & 8191) / 32;
+    int pg_blk_num = (((long) block) & (PAGESIZE - 1)) / 32;
     int index_offset = pg_blk_num / 32;
     int mask = 1 << (pg_blk_num % 32);
 
-    int *freelist = (root->ptr + sizeof(int));
-    freelist[10 + NUMPAGES + index_offset + (8 * pg_ndx)] &= ~mask;
+    int *bitmap = BITMAP(root->ptr + sizeof(int));
+    bitmap[index_offset + (8 * pg_ndx)] &= ~mask;
 }
 
 inline int check_bitmask(void *block) {
     int pg_ndx = get_page_index(block);
-    int pg_blk_num = (((int) block) & 8191) / 32;
+    int pg_blk_num = (((long) block) & (PAGESIZE - 1)) / 32;
     int index_offset = pg_blk_num / 32;
     int mask = 1 << (pg_blk_num % 32);
 
-    int *freelist = (root->ptr + sizeof(int));
+    int *bitmap = BITMAP(root->ptr + sizeof(int));
     //0 if bit is unset, else some non-zero value
-    return freelist[10 + NUMPAGES + index_offset + (8 * pg_ndx)] & mask;
+    return bitmap[index_offset + (8 * pg_ndx)] & mask;
+}
+
+
+//add a free block to the head or the tail of its list
+inline void push_block(void *block, int ndx, int to_tail) {
+    void **freelist = (root->ptr + sizeof(int));
+    free_list *buffer = block;
+    buffer->list_ndx = ndx;
+    if (freelist[ndx] == NULL) {
+        buffer->next = buffer->prev = NULL;
+        freelist[ndx] = freelist[TAIL + ndx] = buffer;
+    }
+    else if (to_tail) {
+        buffer->next = NULL;
+        buffer->prev = freelist[TAIL + ndx];
+        buffer->prev->next = buffer;
+        freelist[TAIL + ndx] = buffer;
+    }
+    else {
+        buffer->next = freelist[ndx];
+        buffer->prev = NULL;
+        buffer->next->prev = buffer;
+        freelist[ndx] = buffer;
+    }
 }
 
+inline void unlink_block(void *block, int ndx) {
+    void **freelist = (root->ptr + sizeof(int));
+    free_list *buffer = block;
+    if (buffer->next != NULL) {
+        buffer->next->prev = buffer->prev;
+    }
+    else {
+        freelist[TAIL + ndx] = buffer->prev;
+    }
+    if (buffer->prev != NULL) {
+        buffer->prev->next = buffer->next;
+    }
+    else {
+        freelist[ndx] = buffer->next;
+    }
+}
+
+//32 byte blocks in use of the superblock a block lies in
+inline unsigned short *superblock_usage(void *block) {
+    kma_page_t **freelist = (root->ptr + sizeof(int));
+    return &USAGE(freelist)[get_page_index(freelist[PAGETABLE + get_page_index(block)]->ptr)];
+}
 
 inline void split_block(void *block, int curr_ndx, int target_ndx) {
     if (curr_ndx == target_ndx) return; //base case - block split to target size
     --curr_ndx;
+    STAT(gStats.splits++);
     int size = size_from_index(curr_ndx);
-    free_list *buddy = buddy_addr(block, size);
 
     //add upper half of block to corresponding free list and recur
-    void **freelist = (root->ptr + sizeof(int));
-    buddy->next = freelist[curr_ndx];
-    buddy->prev = NULL;
-    buddy->list_ndx = curr_ndx;
-    if (buddy->next != NULL) {
-        buddy->next->prev = buddy;
-    }
-    freelist[curr_ndx] = buddy;
+    push_block(buddy_addr(block, size), curr_ndx, FALSE);
 
     split_block(block, curr_ndx, target_ndx);
 }
 
 inline void *merge_block(void *block, int *ndx) {
-    //base case - full page block
-    if (*ndx == 8) {
+    kma_page_t **freelist = (root->ptr + sizeof(int));
+    int size = size_from_index(*ndx);
+    //base case - full superblock
+    if (size == freelist[PAGETABLE + get_page_index(block)]->size) {
         return NULL;
     }
-    int size = size_from_index(*ndx);
     free_list *buddy = buddy_addr(block, size);
     if (check_bitmask(buddy) != 0 || buddy->list_ndx != *ndx) { //buddy is occupied or further split up
         return block;
     }
     //remove from free list and merge with buddy
-    if (buddy->next != NULL) {
-        buddy->next->prev = buddy->prev;
+    STAT(gStats.merges++);
+    unlink_block(buddy, *ndx);
+
+    ++(*ndx);
+    return merge_block(MIN(block, (void *) buddy), ndx); //recur
+}
+
+//keep the first keep bytes of an allocated block and free the rest
+inline void trim_block(void *block, int ndx, int keep) {
+    int size = size_from_index(ndx);
+    while (keep < size) {
+        size /= 2;
+        --ndx;
+        STAT(gStats.splits++);
+        if (keep <= size) {
+            push_block(block + size, ndx, TRUE);
+        }
+        else {
+            //the lower half stays allocated, go on in the upper one
+            block += size;
+            keep -= size;
+            set_bitmask(block);
+        }
     }
+}
 
-    if (buddy->prev != NULL) {
-        buddy->prev->next = buddy->next;
+//free an allocated block and merge it to the largest possible size
+inline void free_block(void *block, int ndx, unsigned short *usage) {
+    unset_bitmask(block);
+    free_list *buffer = merge_block(block, &ndx);
+    if (buffer == NULL) { // unused superblock
+        release_superblock(block);
     }
     else {
-        void **freelist = (root->ptr + sizeof(int));
-        freelist[*ndx] = buddy->next;
+        //a mostly empty superblock is served last
+        kma_page_t **freelist = (root->ptr + sizeof(int));
+        kma_page_t *super = freelist[PAGETABLE + get_page_index(block)];
+        push_block(buffer, ndx, 100L * 32 * *usage < (long) FULLNESS * super->size);
     }
+}
 
-    ++(*ndx);
-    return merge_block((void *) (((int) block) & ((int) buddy)), ndx); //recur
+kma_page_t *get_superblock(int ndx) {
+    kma_page_t **freelist = (root->ptr + sizeof(int));
+    int size = size_from_index(MAX(ndx, SUPERORDER));
+
+    //reuse the cached superblock before going back to the page allocator
+    kma_page_t *page = freelist[SPARE];
+    if (page != NULL && page->size >= size) {
+        freelist[SPARE] = NULL;
+        return page;
+    }
+
+    page = get_pages(size / PAGESIZE);
+    STAT(gStats.refills++);
+    int pg_ndx = get_page_index(page->ptr);
+    if (pg_ndx + size / PAGESIZE > NUMPAGES(freelist)) {
+        grow(pg_ndx + size / PAGESIZE);
+        freelist = (root->ptr + sizeof(int));
+    }
+    int i;
+    for (i = 0; i < size / PAGESIZE; i++) {
+        freelist[PAGETABLE + pg_ndx + i] = page;
+    }
+    return page;
+}
+
+void release_superblock(void *ptr) {
+    kma_page_t **freelist = (root->ptr + sizeof(int));
+    kma_page_t *page = freelist[PAGETABLE + get_page_index(ptr)];
+    int pg_ndx = get_page_index(page->ptr);
+
+    //free up bitmap
+    memset(&BITMAP(freelist)[8 * pg_ndx], 0, 8 * (page->size / PAGESIZE) * sizeof(int));
+
+    //keep one free superblock around so a refill does not hit the page allocator
+    if (freelist[SPARE] == NULL) {
+        freelist[SPARE] = page;
+        return;
+    }
+
+    memset(&freelist[PAGETABLE + pg_ndx], 0, (page->size / PAGESIZE) * sizeof(void *));
+    STAT(gStats.releases++);
+    free_pages(page);
 }
 
 
 void *kma_malloc(kma_size_t size) {
-    //return immediately for too large a request
-    if ((size + sizeof(kma_page_t * )) > PAGESIZE) return NULL;
+    //serve too large a request for the biggest buddy order from a page run
+    if (size > MAXSIZE) return get_large(size);
 
     if (root == NULL) init();
 
     ++(*((int *) root->ptr)); //update used count
+    STAT(gStats.slack_bytes -= size);
     size = MAX(32, size);
 
     void **freelist = (root->ptr + sizeof(int));
     int ndx = get_list_index(size);
+    int keep = KEEPSIZE(size);
+    STAT(gStats.classes[ndx].live++);
+    STAT(gStats.classes[ndx].allocs++);
+    STAT(gStats.slack_bytes += keep);
 
     //remove smallest available block from its list, update bitmap, split to desired size
     int i;
-    for (i = ndx; i < 8; i++) {
+    for (i = ndx; i < MAXORDER; i++) {
         if (freelist[i] != NULL) {
             free_list *buffer = freelist[i];
             //assert(check_bitmask(buffer) == 0);
-            //assert(((size_from_index(ndx) - 1) & ((int) buffer)) == 0);
-            if (buffer->next != NULL) {
-                buffer->next->prev = buffer->prev;
-            }
-            freelist[i] = buffer->next;
+            unlink_block(buffer, i);
             set_bitmask(buffer);
             split_block(buffer, i, ndx);
+            trim_block(buffer, ndx, keep);
+            *superblock_usage(buffer) += keep / 32;
             return buffer;
         }
     }
-    //allocate new page and split
-    kma_page_t *page = get_page();
+    //take a new superblock and split
+    kma_page_t *page = get_superblock(ndx);
     void *buffer = page->ptr;
-    int pg_ndx = get_page_index(buffer);
-    freelist[15 + pg_ndx] = page;
     set_bitmask(buffer);
-    split_block(buffer, 8, ndx);
+    split_block(buffer, get_list_index(page->size), ndx);
+    trim_block(buffer, ndx, keep);
+    *superblock_usage(buffer) += keep / 32;
 
     return buffer;
 }
 
 void kma_free(void *ptr, kma_size_t size) {
+    if (size > MAXSIZE) {
+        free_large(ptr, size);
+        return;
+    }
+    STAT(gStats.slack_bytes += size);
     size = MAX(32, size);
     void **freelist = (root->ptr + sizeof(int));
 
-    //unset bitmap and merge to largest possible size
-    unset_bitmask(ptr);
-
-    int ndx = get_list_index(size);
-    free_list *buffer = merge_block(ptr, &ndx);
-    if (buffer == NULL) { // unused page
-        int pg_ndx = get_page_index(ptr);
-
-        //free up bitmap
-        freelist[10 + NUMPAGES + (8 * pg_ndx)] = 0;
-        freelist[10 + NUMPAGES + (8 * pg_ndx) + 1] = 0;
-        freelist[10 + NUMPAGES + (8 * pg_ndx) + 2] = 0;
-        freelist[10 + NUMPAGES + (8 * pg_ndx) + 3] = 0;
-        freelist[10 + NUMPAGES + (8 * pg_ndx) + 4] = 0;
-        freelist[10 + NUMPAGES + (8 * pg_ndx) + 5] = 0;
-        freelist[10 + NUMPAGES + (8 * pg_ndx) + 6] = 0;
-        freelist[10 + NUMPAGES + (8 * pg_ndx) + 7] = 0;
-        free_page(freelist[15 + pg_ndx]);
-        freelist[15 + pg_ndx] = NULL;
-    }
-    else {
-        buffer->next = freelist[ndx];
-        buffer->prev = NULL;
-        buffer->list_ndx = ndx;
-        if (buffer->next != NULL) {
-            buffer->next->prev = buffer;
-        }
-        freelist[ndx] = buffer;
+    int keep = KEEPSIZE(size);
+    STAT(gStats.classes[get_list_index(size)].live--);
+    STAT(gStats.slack_bytes -= keep);
+    unsigned short *usage = superblock_usage(ptr);
+    *usage -= keep / 32;
+
+    //free the pieces trim_block left, largest first; only the last one can
+    //empty the superblock
+    while (keep > 0) {
+        int piece = 31 - __builtin_clz(keep);
+        free_block(ptr, piece - 5, usage);
+        ptr += 1 << piece;
+        keep -= 1 << piece;
     }
 
     //update used pages count and release control page if everything free
     if (0 == --(*((int *) root->ptr))) {
         int i;
-        for (i = NUMPAGES - 1; i > -1; --i) {
-            if (freelist[10 + i] != NULL)
-                free_page(freelist[10 + i]);
+        for (i = NUMPAGES(freelist) - 1; i > -1; --i) {
+            kma_page_t *page = freelist[PAGETABLE + i];
+            if (page != NULL) {
+                //clear the entries of all pages of the superblock
+                memset(&freelist[PAGETABLE + get_page_index(page->ptr)], 0,
+                       (page->size / PAGESIZE) * sizeof(void *));
+                STAT(gStats.releases++);
+                free_pages(page);
+            }
         }
+        STAT(gStats.meta_bytes -= root->size);
         free_page(root);
         root = NULL;
     }
 }
 
+#ifdef KMA_STATS
+kma_stat_t *kma_stats() {
+    static kma_stat_t stats;
+
+    //one class per buddy order, whole superblocks are never on a list
+    memcpy(&stats, &gStats, sizeof(kma_stat_t));
+    stats.num_classes = MAXORDER + 1;
+    int i;
+    for (i = 0; i <= MAXORDER; i++) {
+        stats.classes[i].size = size_from_index(i);
+        stats.classes[i].free = 0;
+    }
+    if (root != NULL) {
+        void **freelist = (root->ptr + sizeof(int));
+        for (i = 0; i < MAXORDER; i++) {
+            free_list *buffer;
+            for (buffer = freelist[i]; buffer != NULL; buffer = buffer->next) {
+                stats.classes[i].free++;
+            }
+        }
+    }
+    return &stats;
+}
+#endif
+
 #endif // KMA_BUD
@@ -0,0 +1,275 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Microbenchmarks for the C++ allocators of kma.hpp
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  Every pattern runs three ways on the engine linked in: kma_malloc and
+ *  kma_free directly, kma::allocator with the size known at run time,
+ *  and kma::allocator with the size a template argument, whose class is
+ *  resolved at compile time. The container patterns run std::pmr::map,
+ *  unordered_map, list and vector workloads on the default resource
+ *  (operator new), on kma::resource directly on the engine and on
+ *  kma::resource through a kma::allocator with its cache.
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+/************Private include**********************************************/
+#include "kma.hpp"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#if defined(KMA_DUMMY)
+#define ENGINE "KMA_DUMMY"
+#elif defined(KMA_RM)
+#define ENGINE "KMA_RM"
+#elif defined(KMA_P2FL)
+#define ENGINE "KMA_P2FL"
+#elif defined(KMA_MCK2)
+#define ENGINE "KMA_MCK2"
+#elif defined(KMA_BUD)
+#define ENGINE "KMA_BUD"
+#elif defined(KMA_LZBUD)
+#define ENGINE "KMA_LZBUD"
+#elif defined(KMA_HYBRID)
+#define ENGINE "KMA_HYBRID"
+#else
+#define ENGINE "unknown"
+#endif
+
+// operations (one allocation or one free) per measurement
+#define NUMOPS (1 << 22)
+
+// objects alive at once in the lifo pattern
+#define NUMOBJS 1024
+
+// elements per container, few enough that kma_dummy (a page each) fits
+// the pool, and rounds of the container patterns
+#define NUMELEMS 2000
+#define ROUNDS 50
+
+// inner vectors of the vector pattern and their largest length
+#define NUMVECS 64
+#define MAXLEN 256
+
+/************Global Variables*********************************************/
+
+static void *gSlots[NUMOBJS];
+
+static unsigned int gSeed;
+
+/************Function Prototypes******************************************/
+static double now();
+static void report(const char *, const char *, int, double);
+static unsigned int rnd();
+template <int SIZE> static void benchSize();
+static void benchContainers(const char *, std::pmr::memory_resource *);
+static double benchMap(std::pmr::memory_resource *);
+static double benchUnorderedMap(std::pmr::memory_resource *);
+static double benchList(std::pmr::memory_resource *);
+static double benchVector(std::pmr::memory_resource *);
+
+/************Implementation***********************************************/
+
+int main() {
+    std::printf("%-10s %-8s %-12s %6s %8s\n", "engine", "pattern", "call", "size", "ns/op");
+
+    // keep one allocation pending so that the engines do not tear down
+    // their bookkeeping between iterations, like the trace harness does
+    void *anchor = kma_malloc(32);
+
+    benchSize<24>();
+    benchSize<48>();
+    benchSize<200>();
+    benchSize<1000>();
+
+    {
+        kma::resource<> direct;
+        kma::resource<kma::allocator<>> cached;
+
+        benchContainers("default", std::pmr::new_delete_resource());
+        benchContainers("kma", &direct);
+        benchContainers("kma+cache", &cached);
+    }
+
+    kma_free(anchor, 32);
+    if (page_stats()->num_in_use != 0) {
+        error((char *) "not all pages freed", (char *) "");
+    }
+    return 0;
+}
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// xorshift, so that every resource sees the same sequence
+static unsigned int rnd() {
+    gSeed ^= gSeed << 13;
+    gSeed ^= gSeed >> 17;
+    gSeed ^= gSeed << 5;
+    return gSeed;
+}
+
+static void report(const char *pattern, const char *call, int size, double ns) {
+    std::printf("%-10s %-8s %-12s %6d %8.1f\n", ENGINE, pattern, call, size, ns);
+}
+
+// allocation followed by the free of the same size (pair), and NUMOBJS
+// allocations freed newest first (lifo)
+template <int SIZE>
+static void benchSize() {
+    kma::allocator<> alloc;
+    // read once per pattern, so the run time size is not a constant
+    volatile int runtime = SIZE;
+    int size = runtime;
+    double start;
+    int i, j;
+
+    start = now();
+    for (i = 0; i < NUMOPS; i += 2) {
+        gSlots[0] = kma_malloc(size);
+        kma_free(gSlots[0], size);
+    }
+    report("pair", "kma_malloc", SIZE, (now() - start) / NUMOPS);
+
+    start = now();
+    for (i = 0; i < NUMOPS; i += 2) {
+        gSlots[0] = alloc.allocate(size);
+        alloc.deallocate(gSlots[0], size);
+    }
+    report("pair", "allocate(n)", SIZE, (now() - start) / NUMOPS);
+
+    start = now();
+    for (i = 0; i < NUMOPS; i += 2) {
+        gSlots[0] = alloc.allocate<SIZE>();
+        alloc.deallocate<SIZE>(gSlots[0]);
+    }
+    report("pair", "allocate<N>", SIZE, (now() - start) / NUMOPS);
+
+    start = now();
+    for (i = 0; i < NUMOPS; i += 2 * NUMOBJS) {
+        for (j = 0; j < NUMOBJS; j++) gSlots[j] = kma_malloc(size);
+        for (j = NUMOBJS - 1; j >= 0; j--) kma_free(gSlots[j], size);
+    }
+    report("lifo", "kma_malloc", SIZE, (now() - start) / NUMOPS);
+
+    start = now();
+    for (i = 0; i < NUMOPS; i += 2 * NUMOBJS) {
+        for (j = 0; j < NUMOBJS; j++) gSlots[j] = alloc.allocate(size);
+        for (j = NUMOBJS - 1; j >= 0; j--) alloc.deallocate(gSlots[j], size);
+    }
+    report("lifo", "allocate(n)", SIZE, (now() - start) / NUMOPS);
+
+    start = now();
+    for (i = 0; i < NUMOPS; i += 2 * NUMOBJS) {
+        for (j = 0; j < NUMOBJS; j++) gSlots[j] = alloc.allocate<SIZE>();
+        for (j = NUMOBJS - 1; j >= 0; j--) alloc.deallocate<SIZE>(gSlots[j]);
+    }
+    report("lifo", "allocate<N>", SIZE, (now() - start) / NUMOPS);
+}
+
+// every container pattern on one resource
+static void benchContainers(const char *call, std::pmr::memory_resource *res) {
+    report("map", call, NUMELEMS, benchMap(res));
+    report("umap", call, NUMELEMS, benchUnorderedMap(res));
+    report("list", call, NUMELEMS, benchList(res));
+    report("vector", call, NUMVECS, benchVector(res));
+}
+
+// insert NUMELEMS random keys, then erase them in insertion order
+static double benchMap(std::pmr::memory_resource *res) {
+    int keys[NUMELEMS];
+    double start = now();
+    int r, i;
+
+    gSeed = 2463534242U;
+    for (r = 0; r < ROUNDS; r++) {
+        std::pmr::map<int, int> map(res);
+        for (i = 0; i < NUMELEMS; i++) {
+            keys[i] = rnd();
+            map[keys[i]] = i;
+        }
+        for (i = 0; i < NUMELEMS; i++) map.erase(keys[i]);
+    }
+    return (now() - start) / (2.0 * ROUNDS * NUMELEMS);
+}
+
+static double benchUnorderedMap(std::pmr::memory_resource *res) {
+    int keys[NUMELEMS];
+    double start = now();
+    int r, i;
+
+    gSeed = 2463534242U;
+    for (r = 0; r < ROUNDS; r++) {
+        std::pmr::unordered_map<int, int> map(res);
+        for (i = 0; i < NUMELEMS; i++) {
+            keys[i] = rnd();
+            map[keys[i]] = i;
+        }
+        for (i = 0; i < NUMELEMS; i++) map.erase(keys[i]);
+    }
+    return (now() - start) / (2.0 * ROUNDS * NUMELEMS);
+}
+
+// append NUMELEMS, erase every other one, then clear the rest
+static double benchList(std::pmr::memory_resource *res) {
+    double start = now();
+    int r, i;
+
+    for (r = 0; r < ROUNDS; r++) {
+        std::pmr::list<int> list(res);
+        for (i = 0; i < NUMELEMS; i++) list.push_back(i);
+        auto it = list.begin();
+        while (it != list.end()) {
+            it = list.erase(it);
+            if (it != list.end()) ++it;
+        }
+        list.clear();
+    }
+    return (now() - start) / (2.0 * ROUNDS * NUMELEMS);
+}
+
+// grow NUMVECS vectors, which take the resource from the outer one, to
+// random lengths element by element; ns per element
+static double benchVector(std::pmr::memory_resource *res) {
+    double start = now();
+    long elems = 0;
+    int r, i, j;
+
+    gSeed = 2463534242U;
+    for (r = 0; r < ROUNDS; r++) {
+        std::pmr::vector<std::pmr::vector<int>> vecs(res);
+        for (i = 0; i < NUMVECS; i++) {
+            vecs.emplace_back();
+            int len = 1 + rnd() % MAXLEN;
+            for (j = 0; j < len; j++) vecs.back().push_back(j);
+            elems += len;
+        }
+    }
+    return (now() - start) / elems;
+}
+
+extern "C" void error(char *message, char *arg) {
+    std::fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+    std::exit(-1);
+}
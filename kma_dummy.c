@@ -47,6 +47,7 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -71,17 +72,17 @@ void* kma_malloc(kma_size_t size)
 {
   kma_page_t* page;
   
-  // get one page
-  page = get_page();
+  // get one page, or a run of pages for a large request
+  page = get_pages(NUMPAGESFOR(size));
   
   // add a pointer to the page structure at the beginning of the page
   *((kma_page_t**)page->ptr) = page;
   
-  if ((size + sizeof(kma_page_t*)) > page->size)
-    { // requested size too large
-      free_page(page);
-      return NULL;
-    }
+  STAT(gStats.classes[0].live++);
+  STAT(gStats.classes[0].allocs++);
+  STAT(gStats.refills++);
+  STAT(gStats.meta_bytes += sizeof(kma_page_t*));
+  STAT(gStats.slack_bytes += page->size - sizeof(kma_page_t*) - size);
   
   // check whether the BASEADDR macro works
   //for (i = 0; i < page->size; i++)
@@ -99,7 +100,26 @@ void kma_free(void* ptr, kma_size_t size)
   
   page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
   
+  STAT(gStats.classes[0].live--);
+  STAT(gStats.releases++);
+  STAT(gStats.meta_bytes -= sizeof(kma_page_t*));
+  STAT(gStats.slack_bytes -= page->size - sizeof(kma_page_t*) - size);
+  
   free_page(page);
 }
 
+#ifdef KMA_STATS
+kma_stat_t* kma_stats()
+{
+  static kma_stat_t stats;
+  
+  // every request gets its own page (run), there is no free list
+  memcpy(&stats, &gStats, sizeof(kma_stat_t));
+  stats.num_classes = 1;
+  stats.classes[0].size = 0;
+  
+  return &stats;
+}
+#endif
+
 #endif // KMA_DUMMY
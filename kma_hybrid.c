@@ -0,0 +1,192 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator that serves each request size from
+ *              the engine best suited to it
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifdef KMA_HYBRID
+#define __KMA_IMPL__
+
+//three tiers on one page pool: requests up to HYBRID_SMALL bytes go to
+//McKusick-Karels pages of one size class each, requests up to HYBRID_MID
+//to buddy superblocks, which coalesce and trim blocks across pages, and
+//anything larger to a run of whole pages
+#ifndef HYBRID_SMALL
+#define HYBRID_SMALL 1024
+#endif
+#ifndef HYBRID_MID
+#define HYBRID_MID (16 * 1024)
+#endif
+
+#ifdef KMA_THREADS
+#error "KMA_THREADS needs a thread safe engine, KMA_MCK2"
+#endif
+
+/************System include***********************************************/
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+#if HYBRID_SMALL + 8 > PAGESIZE
+#error "HYBRID_SMALL must leave room for a page pointer in a page"
+#endif
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+#ifdef KMA_STATS
+//the buddy tier counts here, so its class counters do not mix with those of the small tier
+kma_stat_t gMidStats;
+#endif
+
+/************Tiers********************************************************/
+//the tiers are the engines themselves, compiled into this file with their
+//global names prefixed; kma.h is already in, so they declare nothing twice
+#undef kma_malloc
+#undef kma_free
+
+#define KMA_MCK2
+#define root small_root
+#define init small_init
+#define grow small_grow
+#define free_buffer small_free_buffer
+#define get_page_index small_page_index
+#define get_list_index small_list_index
+#define size_from_index small_size_from_index
+#define kClassSizes kSmallClassSizes
+#define kClassOf kSmallClassOf
+#define kma_malloc small_malloc
+#define kma_free small_free
+#define kma_stats small_stats
+#include "kma_mck2.c"
+#undef KMA_MCK2
+#undef root
+#undef init
+#undef grow
+#undef free_buffer
+#undef get_page_index
+#undef get_list_index
+#undef size_from_index
+#undef kClassSizes
+#undef kClassOf
+#undef kma_malloc
+#undef kma_free
+#undef kma_stats
+#undef CAPACITY
+#undef NUMPAGES
+#undef PAGEPTRS
+#undef PAGEUSE
+#undef BOOKPAGES
+
+#define KMA_BUD
+#define gStats gMidStats
+#define root mid_root
+#define init mid_init
+#define grow mid_grow
+#define get_page_index mid_page_index
+#define get_list_index mid_list_index
+#define size_from_index mid_size_from_index
+#define buddy_addr mid_buddy_addr
+#define set_bitmask mid_set_bitmask
+#define unset_bitmask mid_unset_bitmask
+#define check_bitmask mid_check_bitmask
+#define push_block mid_push_block
+#define unlink_block mid_unlink_block
+#define superblock_usage mid_superblock_usage
+#define split_block mid_split_block
+#define merge_block mid_merge_block
+#define trim_block mid_trim_block
+#define free_block mid_free_block
+#define get_superblock mid_get_superblock
+#define release_superblock mid_release_superblock
+#define kma_malloc mid_malloc
+#define kma_free mid_free
+#define kma_stats mid_stats
+#include "kma_bud.c"
+#undef KMA_BUD
+#undef gStats
+#undef kma_malloc
+#undef kma_free
+#undef kma_stats
+
+#if HYBRID_MID > MAXSIZE
+#error "HYBRID_MID is beyond the largest buddy block"
+#endif
+
+#ifdef KMA_PERCPU
+#define kma_malloc engine_malloc
+#define kma_free engine_free
+#endif
+
+/************Function Prototypes******************************************/
+#ifdef KMA_STATS
+void fold_stats();
+#endif
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void *kma_malloc(kma_size_t size) {
+    if (size <= HYBRID_SMALL) return small_malloc(size);
+    if (size > HYBRID_MID) return get_large(size);
+
+    void *buffer = mid_malloc(size);
+    STAT(fold_stats());
+    return buffer;
+}
+
+void kma_free(void *ptr, kma_size_t size) {
+    if (size <= HYBRID_SMALL) {
+        small_free(ptr, size);
+    } else if (size > HYBRID_MID) {
+        free_large(ptr, size);
+    } else {
+        mid_free(ptr, size);
+        STAT(fold_stats());
+    }
+}
+
+#ifdef KMA_STATS
+//move the engine wide counters of the buddy tier to gStats, which kma.c reads directly
+void fold_stats() {
+    gStats.splits += gMidStats.splits;
+    gStats.merges += gMidStats.merges;
+    gStats.refills += gMidStats.refills;
+    gStats.releases += gMidStats.releases;
+    gStats.meta_bytes += gMidStats.meta_bytes;
+    gStats.slack_bytes += gMidStats.slack_bytes;
+    gMidStats.splits = gMidStats.merges = gMidStats.refills = gMidStats.releases = 0;
+    gMidStats.meta_bytes = gMidStats.slack_bytes = 0;
+}
+
+kma_stat_t *kma_stats() {
+    static kma_stat_t stats;
+
+    //the classes of the small tier, then the buddy orders the mid tier serves
+    kma_stat_t *mid = mid_stats();
+    memcpy(&stats, small_stats(), sizeof(kma_stat_t));
+    stats.num_classes = small_list_index(HYBRID_SMALL) + 1;
+    int i;
+    for (i = mid_list_index(HYBRID_SMALL + 1); i <= MAXORDER && stats.num_classes < KMA_NUMCLASSES; i++) {
+        stats.classes[stats.num_classes++] = mid->classes[i];
+    }
+    return &stats;
+}
+#endif
+
+#endif // KMA_HYBRID
@@ -0,0 +1,338 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: malloc replacement on top of a kma engine
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  Built as libkma.so by "make lib" (LIBENGINE selects the engine, the
+ *  competition engine by default) and used with
+ *
+ *    LD_PRELOAD=./libkma.so program args
+ *
+ *  Every buffer is preceded by a header that keeps the size handed to
+ *  kma_free. The engines are not thread safe, so all calls into them
+ *  are serialized by one lock, except with KMA_THREADS, where kma_mck2
+ *  gives every thread its own heap and only the page pool is locked:
+ *
+ *    make lib LIBENGINE=KMA_MCK2 OPTS=-DKMA_THREADS
+ *
+ *  and with KMA_PERCPU, where kma_percpu.c caches buffers per CPU and
+ *  locks the engine itself on a miss.
+ *
+ *  Requests of MMAPSIZE and up, and any
+ *  request that would take the engine past KMAPAGES pages, are mapped
+ *  directly instead.
+ ***************************************************************************/
+
+#define __KMA_LIB_IMPL__
+#define _GNU_SOURCE
+
+/************System include***********************************************/
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// malloc guarantees this alignment
+#define ALIGN 16
+
+// requests from here on are mapped directly
+#define MMAPSIZE (256 * 1024)
+
+// pages the engine may hold. The page layer aborts when the pool is out of
+// pages, and an engine asks for runs of contiguous pages (superblocks of up
+// to 128 pages, grown tables) on top of the request it serves, so a quarter
+// of the pool is left free for those runs; past that requests are mapped
+#ifndef KMAPAGES
+#define KMAPAGES (MAXPAGES - MAXPAGES / 4)
+#endif
+
+#ifdef KMA_THREADS
+#ifndef KMA_MCK2
+#error "KMA_THREADS needs a thread safe engine, KMA_MCK2"
+#endif
+#endif
+#if defined(KMA_THREADS) || defined(KMA_PERCPU)
+#define ENGINELOCK()
+#define ENGINEUNLOCK()
+#else
+#define ENGINELOCK() lock()
+#define ENGINEUNLOCK() unlock()
+#endif
+
+#define KIND_KMA 0x6b6d6131
+#define KIND_MMAP 0x6b6d6132
+
+typedef struct
+{
+  size_t size;			// bytes taken from the engine or mapped
+  unsigned int offset;		// from the start of those bytes to the buffer
+  unsigned int kind;
+} header_t;
+
+#define HEADER(ptr) ((header_t*) (ptr) - 1)
+
+/************Global Variables*********************************************/
+
+static pthread_mutex_t gLock = PTHREAD_MUTEX_INITIALIZER;
+
+static long gOsPage = 0;
+
+// glibc's malloc_usable_size, for buffers that are not ours
+static size_t (*gLibcUsableSize)(void*) = NULL;
+
+/************Function Prototypes******************************************/
+extern void* __libc_malloc(size_t);
+extern void* __libc_realloc(void*, size_t);
+extern void __libc_free(void*);
+
+static void init() __attribute__((constructor));
+static void lock();
+static void unlock();
+static void* allocate(size_t, size_t);
+static void release(void*);
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+static void
+init()
+{
+  gOsPage = sysconf(_SC_PAGESIZE);
+  pthread_atfork(lock, unlock, unlock);
+}
+
+static void
+lock()
+{
+  pthread_mutex_lock(&gLock);
+}
+
+static void
+unlock()
+{
+  pthread_mutex_unlock(&gLock);
+}
+
+// a buffer of size bytes aligned to align (a power of two >= ALIGN)
+static void*
+allocate(size_t size, size_t align)
+{
+  size_t need;
+  void* base = NULL;
+  unsigned int kind = KIND_KMA;
+  uintptr_t buf;
+
+  if (size > SIZE_MAX / 2)
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  need = size + sizeof(header_t) + align - 1;
+
+  if (need < MMAPSIZE && align <= PAGESIZE)
+    {
+      ENGINELOCK();
+      if (page_stats()->num_in_use + NUMPAGESFOR(need) <= KMAPAGES)
+	{
+	  base = kma_malloc(need);
+	}
+      ENGINEUNLOCK();
+    }
+
+  if (base == NULL)
+    {
+      if (gOsPage == 0)
+	gOsPage = sysconf(_SC_PAGESIZE);
+      need = (need + gOsPage - 1) & ~(gOsPage - 1);
+      base = mmap(NULL, need, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (base == MAP_FAILED)
+	{
+	  errno = ENOMEM;
+	  return NULL;
+	}
+      kind = KIND_MMAP;
+    }
+
+  buf = ((uintptr_t) base + sizeof(header_t) + align - 1) & ~(uintptr_t) (align - 1);
+  HEADER(buf)->size = need;
+  HEADER(buf)->offset = buf - (uintptr_t) base;
+  HEADER(buf)->kind = kind;
+  return (void*) buf;
+}
+
+static void
+release(void* ptr)
+{
+  header_t* h = HEADER(ptr);
+  void* base = ptr - h->offset;
+
+  switch (h->kind)
+    {
+    case KIND_KMA:
+      h->kind = 0;
+      ENGINELOCK();
+      kma_free(base, h->size);
+      ENGINEUNLOCK();
+      break;
+    case KIND_MMAP:
+      h->kind = 0;
+      munmap(base, h->size);
+      break;
+    default:
+      // not ours, e.g. handed out by glibc before we were loaded
+      __libc_free(ptr);
+    }
+}
+
+void*
+malloc(size_t size)
+{
+  return allocate(size, ALIGN);
+}
+
+void
+free(void* ptr)
+{
+  if (ptr != NULL)
+    release(ptr);
+}
+
+void*
+calloc(size_t n, size_t size)
+{
+  void* ptr;
+
+  if (size != 0 && n > SIZE_MAX / size)
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  ptr = allocate(n * size, ALIGN);
+  if (ptr != NULL && HEADER(ptr)->kind == KIND_KMA)
+    memset(ptr, 0, n * size);
+  return ptr;
+}
+
+void*
+realloc(void* old, size_t size)
+{
+  void* ptr;
+  size_t usable;
+
+  if (old == NULL)
+    return malloc(size);
+  if (size == 0)
+    {
+      free(old);
+      return NULL;
+    }
+  if (HEADER(old)->kind != KIND_KMA && HEADER(old)->kind != KIND_MMAP)
+    return __libc_realloc(old, size);
+
+  usable = malloc_usable_size(old);
+  if (size <= usable)
+    return old;
+
+  ptr = malloc(size);
+  if (ptr != NULL)
+    {
+      memcpy(ptr, old, usable);
+      free(old);
+    }
+  return ptr;
+}
+
+int
+posix_memalign(void** out, size_t align, size_t size)
+{
+  void* ptr;
+
+  if (align < sizeof(void*) || (align & (align - 1)) != 0)
+    return EINVAL;
+
+  ptr = allocate(size, align < ALIGN ? ALIGN : align);
+  if (ptr == NULL)
+    return ENOMEM;
+  *out = ptr;
+  return 0;
+}
+
+void*
+memalign(size_t align, size_t size)
+{
+  void* ptr = NULL;
+  int result = posix_memalign(&ptr, align, size);
+
+  if (result != 0)
+    {
+      errno = result;
+      return NULL;
+    }
+  return ptr;
+}
+
+void*
+aligned_alloc(size_t align, size_t size)
+{
+  return memalign(align, size);
+}
+
+void*
+valloc(size_t size)
+{
+  return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+size_t
+malloc_usable_size(void* ptr)
+{
+  header_t* h;
+
+  if (ptr == NULL)
+    return 0;
+  h = HEADER(ptr);
+  if (h->kind == KIND_KMA || h->kind == KIND_MMAP)
+    return h->size - h->offset;
+
+  // not ours, e.g. handed out by glibc before we were loaded
+  if (gLibcUsableSize == NULL)
+    gLibcUsableSize = dlsym(RTLD_NEXT, "malloc_usable_size");
+  return gLibcUsableSize(ptr);
+}
+
+// the engines and the page layer call this on fatal errors
+void
+error(char* message, char* arg)
+{
+  const char prefix[] = "libkma: ";
+
+  if (write(2, prefix, sizeof(prefix) - 1) < 0
+      || write(2, message, strlen(message)) < 0
+      || write(2, " ", 1) < 0 || write(2, arg, strlen(arg)) < 0
+      || write(2, "\n", 1) < 0)
+    errno = 0;
+  abort();
+}
@@ -45,11 +45,24 @@
 #define __KMA_IMPL__
 #define MAX(a, b) (((a)>(b))?(a):(b))
 #define MIN(a, b) (((a)<(b))?(a):(b))
-#define NUMPAGES 1300
+
+//contiguous bookkeeping pages: used count, list heads, slack, number of pool
+//pages covered, then per pool page (page_number) the page pointer and a
+//bitmap with one bit per 32 byte block. They start as one page and grow
+//(GROWPAGES), by copying, when a page lies beyond them.
+#define SLACK 9 //freelist index of the lazy buddy slack count
+#define CAPACITY 10 //freelist index of the number of pages covered
+#define PAGETABLE 11 //freelist index of the page pointer table
+#define PAGEBYTES (sizeof(void *) + 8 * sizeof(int)) //bookkeeping per pool page
+#define BOOKPAGES(pages) ((int) ((sizeof(int) + PAGETABLE * sizeof(void *) \
+                                  + (pages) * PAGEBYTES + PAGESIZE - 1) / PAGESIZE))
+#define NUMPAGES(fl) ((long) ((void **) (fl))[CAPACITY])
+#define BITMAP(fl) ((int *) &((void **) (fl))[PAGETABLE + NUMPAGES(fl)])
 
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -75,6 +88,8 @@ typedef struct free_list {
 /************Function Prototypes******************************************/
 void init();
 
+void grow(int);
+
 inline int get_list_index(kma_size_t);
 
 inline int size_from_index(int);
@@ -97,10 +112,11 @@ inline void *merge_block(void *, int *);
 
 //TODO update to double-linked list
 void init() {
-    //fetch a page and initialize our bookkeeping
+    //fetch a page run and initialize our bookkeeping
     root = get_page();
+    STAT(gStats.meta_bytes += root->size);
     *((int *) root->ptr) = 0; //track number of allocated buffers
-    kma_page_t **freelist = (root->ptr + sizeof(int));
+    void **freelist = (root->ptr + sizeof(int));
     freelist[0] = NULL; //size 32 list head
     freelist[1] = NULL; //size 64 list head
     freelist[2] = NULL; //size 128 list head
@@ -109,20 +125,36 @@ void init() {
     freelist[5] = NULL; //size 1024 list head
     freelist[6] = NULL; //size 2048 list head
     freelist[7] = NULL; //size 4096 list head
-    freelist[9] = 0; //slack
-
-    //additional pages for bookkeeping
-    freelist[10] = get_page();
-    freelist[11] = get_page();
-    freelist[12] = get_page();
-    freelist[13] = get_page();
-    freelist[14] = get_page();
-    freelist[15] = get_page();
+    freelist[8] = NULL; //whole pages are never listed
+    freelist[SLACK] = 0;
+    freelist[CAPACITY] = (void *) ((PAGESIZE - sizeof(int) - PAGETABLE * sizeof(void *)) / PAGEBYTES);
+
+    memset(&freelist[PAGETABLE], 0, NUMPAGES(freelist) * PAGEBYTES);
+}
+
+//move the bookkeeping to a run that covers pool pages up to pages - 1
+void grow(int pages) {
+    void **freelist = (root->ptr + sizeof(int));
+    long old = NUMPAGES(freelist);
+    long cap = MAX(GROWPAGES(old), pages);
+    int n = BOOKPAGES(cap);
+    cap = (n * PAGESIZE - sizeof(int) - PAGETABLE * sizeof(void *)) / PAGEBYTES;
+
+    kma_page_t *book = get_pages(n);
+    STAT(gStats.meta_bytes += book->size - root->size);
+    void **grown = (book->ptr + sizeof(int));
+    memcpy(book->ptr, root->ptr, sizeof(int) + (PAGETABLE + old) * sizeof(void *));
+    memset(&grown[PAGETABLE + old], 0, (cap - old) * sizeof(void *));
+    grown[CAPACITY] = (void *) cap;
+    memcpy(BITMAP(grown), BITMAP(freelist), 8 * old * sizeof(int));
+    memset(&BITMAP(grown)[8 * old], 0, 8 * (cap - old) * sizeof(int));
+
+    free_pages(root);
+    root = book;
 }
 
 inline int get_page_index(void *ptr) {
-    kma_page_t **freelist = (root->ptr + sizeof(int));
-    return (BASEADDR(ptr) - freelist[15]->ptr) / 8192;
+    return page_number(ptr);
 }
 
 inline int get_list_index(kma_size_t size) {
@@ -134,45 +166,46 @@ inline int size_from_index(int ndx) {
 }
 
 inline void *buddy_addr(void *orig, int size) {
-    return (void *) (((int) orig) ^ size);
+    return (void *) (((long) orig) ^ size);
 }
 
 
 inline void set_bitmask(void *block) {
     int pg_ndx = get_page_index(block);
-    int pg_blk_num = (((int) block) & 8191) / 32;
+    int pg_blk_num = (((long) block) & (PAGESIZE - 1)) / 32;
     int index_offset = pg_blk_num / 32;
     int mask = 1 << (pg_blk_num % 32);
 
-    int *freelist = (root->ptr + sizeof(int));
-    freelist[10 + NUMPAGES + index_offset + (8 * pg_ndx)] |= mask;
+    int *bitmap = BITMAP(root->ptr + sizeof(int));
+    bitmap[index_offset + (8 * pg_ndx)] |= mask;
 }
 
 inline void unset_bitmask(void *block) {
     int pg_ndx = get_page_index(block);
-    int pg_blk_num = (((int) block) & 8191) / 32;
+    int pg_blk_num = (((long) block) & (PAGESIZE - 1)) / 32;
     int index_offset = pg_blk_num / 32;
     int mask = 1 << (pg_blk_num % 32);
 
-    int *freelist = (root->ptr + sizeof(int));
-    freelist[10 + NUMPAGES + index_offset + (8 * pg_ndx)] &= ~mask;
+    int *bitmap = BITMAP(root->ptr + sizeof(int));
+    bitmap[index_offset + (8 * pg_ndx)] &= ~mask;
 }
 
 inline int check_bitmask(void *block) {
     int pg_ndx = get_page_index(block);
-    int pg_blk_num = (((int) block) & 8191) / 32;
+    int pg_blk_num = (((long) block) & (PAGESIZE - 1)) / 32;
     int index_offset = pg_blk_num / 32;
     int mask = 1 << (pg_blk_num % 32);
 
-    int *freelist = (root->ptr + sizeof(int));
+    int *bitmap = BITMAP(root->ptr + sizeof(int));
     //0 if bit is unset, else some non-zero value
-    return freelist[10 + NUMPAGES + index_offset + (8 * pg_ndx)] & mask;
+    return bitmap[index_offset + (8 * pg_ndx)] & mask;
 }
 
 
 inline void split_block(void *block, int curr_ndx, int target_ndx) {
     if (curr_ndx == target_ndx) return; //base case - block split to target size
     --curr_ndx;
+    STAT(gStats.splits++);
     int size = size_from_index(curr_ndx);
     free_list *buddy = buddy_addr(block, size);
 
@@ -201,6 +234,7 @@ inline void *merge_block(void *block, int *ndx) {
         return block;
     }
     //remove from free list and merge with buddy
+    STAT(gStats.merges++);
     if (buddy->next != NULL) {
         buddy->next->prev = buddy->prev;
     }
@@ -214,21 +248,25 @@ inline void *merge_block(void *block, int *ndx) {
     }
 
     ++(*ndx);
-    return merge_block((void *) (((int) block) & ((int) buddy)), ndx); //recur
+    return merge_block((void *) (((long) block) & ((long) buddy)), ndx); //recur
 }
 
 
 void *kma_malloc(kma_size_t size) {
-    //return immediately for too large a request
-    if ((size + sizeof(kma_page_t * )) > PAGESIZE) return NULL;
+    //serve too large a request from a page run
+    if (ISLARGE(size)) return get_large(size);
 
     if (root == NULL) init();
 
     ++(*((int *) root->ptr)); //update used count
+    STAT(gStats.slack_bytes -= size);
     size = MAX(32, size);
 
     void **freelist = (root->ptr + sizeof(int));
     int ndx = get_list_index(size);
+    STAT(gStats.classes[ndx].live++);
+    STAT(gStats.classes[ndx].allocs++);
+    STAT(gStats.slack_bytes += size_from_index(ndx));
 
     //remove smallest available block from its list, update bitmap, split to desired size
     int i;
@@ -241,7 +279,7 @@ void *kma_malloc(kma_size_t size) {
                 buffer->next->prev = buffer->prev;
             }
             freelist[i] = buffer->next;
-            freelist[9] += check_bitmask(buffer) ? 2 : 1;
+            freelist[SLACK] += check_bitmask(buffer) ? 2 : 1;
             set_bitmask(buffer);
             //assert(check_bitmask(buffer) != 0);
             split_block(buffer, i, ndx);
@@ -250,17 +288,27 @@ void *kma_malloc(kma_size_t size) {
     }
     //allocate new page and split
     kma_page_t *page = get_page();
+    STAT(gStats.refills++);
     void *buffer = page->ptr;
     int pg_ndx = get_page_index(buffer);
-    freelist[15 + pg_ndx] = page;
+    if (pg_ndx >= NUMPAGES(freelist)) {
+        grow(pg_ndx + 1);
+        freelist = (root->ptr + sizeof(int));
+    }
+    freelist[PAGETABLE + pg_ndx] = page;
     set_bitmask(buffer);
     split_block(buffer, 8, ndx);
-    freelist[9] += 1;
+    freelist[SLACK] += 1;
 
     return buffer;
 }
 
 void kma_free(void *ptr, kma_size_t size) {
+    if (ISLARGE(size)) {
+        free_large(ptr, size);
+        return;
+    }
+    STAT(gStats.slack_bytes += size);
     size = MAX(32, size);
     void **freelist = (root->ptr + sizeof(int));
 
@@ -268,26 +316,22 @@ void kma_free(void *ptr, kma_size_t size) {
     unset_bitmask(ptr);
 
     int ndx = get_list_index(size);
+    STAT(gStats.classes[ndx].live--);
+    STAT(gStats.slack_bytes -= size_from_index(ndx));
 
-    freelist[9] -= 2;
+    freelist[SLACK] -= 2;
 
-    if (((int) freelist[9]) < 2) {
-        freelist[9] += 1;
+    if (((long) freelist[SLACK]) < 2) {
+        freelist[SLACK] += 1;
         free_list *buffer = merge_block(ptr, &ndx);
         if (buffer == NULL) { // unused page
             int pg_ndx = get_page_index(ptr);
 
             //free up bitmap
-            freelist[10 + NUMPAGES + (8 * pg_ndx)] = 0;
-            freelist[10 + NUMPAGES + (8 * pg_ndx) + 1] = 0;
-            freelist[10 + NUMPAGES + (8 * pg_ndx) + 2] = 0;
-            freelist[10 + NUMPAGES + (8 * pg_ndx) + 3] = 0;
-            freelist[10 + NUMPAGES + (8 * pg_ndx) + 4] = 0;
-            freelist[10 + NUMPAGES + (8 * pg_ndx) + 5] = 0;
-            freelist[10 + NUMPAGES + (8 * pg_ndx) + 6] = 0;
-            freelist[10 + NUMPAGES + (8 * pg_ndx) + 7] = 0;
-            free_page(freelist[15 + pg_ndx]);
-            freelist[15 + pg_ndx] = NULL;
+            memset(&BITMAP(freelist)[8 * pg_ndx], 0, 8 * sizeof(int));
+            STAT(gStats.releases++);
+            free_page(freelist[PAGETABLE + pg_ndx]);
+            freelist[PAGETABLE + pg_ndx] = NULL;
         }
         else {
             buffer->next = freelist[ndx];
@@ -317,13 +361,41 @@ void kma_free(void *ptr, kma_size_t size) {
     if (0 == --(*((int *) root->ptr))) {
         void **freelist = (root->ptr + sizeof(int));
         int i;
-        for (i = NUMPAGES - 1; i > -1; --i) {
-            if (freelist[10 + i] != NULL)
-                free_page(freelist[10 + i]);
+        for (i = NUMPAGES(freelist) - 1; i > -1; --i) {
+            if (freelist[PAGETABLE + i] != NULL) {
+                STAT(gStats.releases++);
+                free_page(freelist[PAGETABLE + i]);
+            }
         }
+        STAT(gStats.meta_bytes -= root->size);
         free_page(root);
         root = NULL;
     }
 }
 
+#ifdef KMA_STATS
+kma_stat_t *kma_stats() {
+    static kma_stat_t stats;
+
+    //one class per buddy order; lazily freed buffers count as free
+    memcpy(&stats, &gStats, sizeof(kma_stat_t));
+    stats.num_classes = 9;
+    int i;
+    for (i = 0; i < 9; i++) {
+        stats.classes[i].size = size_from_index(i);
+        stats.classes[i].free = 0;
+    }
+    if (root != NULL) {
+        void **freelist = (root->ptr + sizeof(int));
+        for (i = 0; i < 9; i++) {
+            free_list *buffer;
+            for (buffer = freelist[i]; buffer != NULL; buffer = buffer->next) {
+                stats.classes[i].free++;
+            }
+        }
+    }
+    return &stats;
+}
+#endif
+
 #endif // KMA_LZBUD
@@ -44,16 +44,48 @@
 
 #ifdef KMA_MCK2
 #define __KMA_IMPL__
+#ifdef KMA_THREADS
+//one heap per thread; heaps share the pool, so pages are indexed from its start
+#define NUMPAGES(fl) MAXPAGES
+//after the list heads: the queue of frees from other threads, the number of buffers on it,
+//the heap's own run and the next orphan
+#define REMOTE KMA_CLASSES
+#define QUEUED (KMA_CLASSES + 1)
+#define SELF (KMA_CLASSES + 2)
+#define NEXT (KMA_CLASSES + 3)
+#define PAGEPTRS (KMA_CLASSES + 4)
+//queued buffers at which the owner drains the queue on its next request, whatever the class
+#define REMOTEDRAIN 64
+//all heaps update gStats
+#define STATADD(x, n) STAT(__atomic_add_fetch(&(x), (n), __ATOMIC_RELAXED))
+#else
+//pages are indexed from the start of the pool too, but the tables start as one page
+//and grow (GROWPAGES), by copying, when a page lies beyond them (see kma_bud.c)
+#define CAPACITY KMA_CLASSES //freelist index of the number of pool pages covered
+#define NUMPAGES(fl) ((long) ((void **) (fl))[CAPACITY])
+#define PAGEPTRS (KMA_CLASSES + 1)
+#define STATADD(x, n) STAT((x) += (n))
+#endif
+//contiguous bookkeeping pages: used count, list heads, page pointers and page usage
+#define PAGEUSE(fl) (PAGEPTRS + NUMPAGES(fl))
+#define BOOKPAGES(pages) ((int) ((sizeof(int) + (PAGEPTRS + 2 * (pages)) * sizeof(void *) + PAGESIZE - 1) / PAGESIZE))
 #define MAX(a, b) (((a)>(b))?(a):(b))
-#define NUMPAGES 1776 //we could allocate another additional bookkeeping page and bump this up
 
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef KMA_THREADS
+#include <pthread.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_classes.h"
+#if KMA_CLASSES < 2
+#error "kma_classes.h needs a class below the page sized one"
+#endif
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
  *  Global variables begin with g. Global constants with k. Local
@@ -62,11 +94,45 @@
  */
 
 /************Global Variables*********************************************/
+#ifdef KMA_THREADS
+__thread kma_page_t *root = NULL;
+
+//the heap (list heads of a bookkeeping run) that owns each page of the pool
+void **volatile gOwner[MAXPAGES];
+
+//heaps whose thread exited while some of their buffers were live; the next new thread adopts one
+void **gOrphans = NULL;
+pthread_mutex_t gOrphansLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t gOnce = PTHREAD_ONCE_INIT;
+pthread_key_t gHeapKey;
+#else
 kma_page_t *root = NULL;
+#endif
+
+//size classes and the class of every request size, see kma_classes.h
+const int kClassSizes[KMA_CLASSES] = KMA_CLASS_SIZES;
+const unsigned char kClassOf[PAGESIZE / KMA_CLASSGRAIN + 1] = KMA_CLASS_OF;
 
 /************Function Prototypes******************************************/
 void init();
 
+void free_buffer(void **, void **, int);
+#ifdef KMA_THREADS
+void init_threads();
+
+void remote_free(void **, void **);
+
+void drain(void **);
+
+void retire_heap(void *);
+#endif
+
+#ifndef KMA_THREADS
+void grow(int);
+#endif
+
+inline int get_page_index(void *);
+
 inline int get_list_index(kma_size_t);
 
 inline int size_from_index(int);
@@ -79,49 +145,125 @@ inline int size_from_index(int);
 //free page head
 //kma_page struct pointers for freeing pages later
 //kmemsizes - unused pages form a linked list; used pages split upper half for number of used buffers, lower half for buffer size
+//
+//with KMA_THREADS every thread allocates from its own heap. A free of a buffer owned by another
+//heap is pushed on that heap's REMOTE queue with a compare and swap, never touching its lists;
+//the owner takes the whole queue with one exchange when a list runs empty, when REMOTEDRAIN
+//buffers have queued up, or when its thread exits, and frees it locally. A buffer stays counted
+//as used until its owner drains it, so a heap cannot be torn down under a remote free. A heap
+//still in use when its thread exits becomes an orphan for the next thread. The heaps share
+//gStats, so with KMA_STATS its counters are updated atomically (STATADD).
 
 void init() {
-    //fetch a page and initialize our bookkeeping
+#ifdef KMA_THREADS
+    pthread_once(&gOnce, init_threads);
+    //adopt an orphan; draining it may free its last buffer and tear it down, then try the next
+    for (;;) {
+        pthread_mutex_lock(&gOrphansLock);
+        void **orphan = gOrphans;
+        if (orphan != NULL) {
+            gOrphans = orphan[NEXT];
+        }
+        pthread_mutex_unlock(&gOrphansLock);
+        if (orphan == NULL) {
+            break;
+        }
+        root = orphan[SELF];
+        pthread_setspecific(gHeapKey, root);
+        drain(orphan);
+        if (root != NULL) {
+            return;
+        }
+    }
+#endif
+    //fetch a page run and initialize our bookkeeping
+#ifdef KMA_THREADS
+    root = get_pages(BOOKPAGES(MAXPAGES));
+#else
     root = get_page();
+#endif
+    STATADD(gStats.meta_bytes, root->size);
     *((int *) root->ptr) = 0; //track number of allocated buffers
     void **freelist = (root->ptr + sizeof(int));
-    freelist[0] = NULL; //size 32 list head
-    freelist[1] = NULL; //size 64 list head
-    freelist[2] = NULL; //size 128 list head
-    freelist[3] = NULL; //size 256 list head
-    freelist[4] = NULL; //size 512 list head
-    freelist[5] = NULL; //size 1024 list head
-    freelist[6] = NULL; //size 2048 list head
-    freelist[7] = NULL; //size 4096 list head
-    freelist[8] = NULL; //size 8192 list head
-    //additional page for bookkeeping
-    freelist[10] = get_page();
+    //one list head per size class of kma_classes.h
+    int i;
+    for (i = 0; i < KMA_CLASSES; i++) {
+        freelist[i] = NULL;
+    }
+#ifdef KMA_THREADS
+    freelist[REMOTE] = NULL;
+    freelist[QUEUED] = 0;
+    freelist[SELF] = root;
+    pthread_setspecific(gHeapKey, root);
+#else
+    freelist[CAPACITY] = (void *) ((PAGESIZE - sizeof(int) - PAGEPTRS * sizeof(void *)) / (2 * sizeof(void *)));
+#endif
+    //page pointers and usage are indexed by pool page
+    for (i = 0; i < NUMPAGES(freelist); i++) {
+        freelist[PAGEPTRS + i] = NULL;
+    }
+}
+
+#ifndef KMA_THREADS
+//move the bookkeeping to a run that covers pool pages up to pages - 1
+void grow(int pages) {
+    void **freelist = (root->ptr + sizeof(int));
+    long old = NUMPAGES(freelist);
+    long cap = MAX(GROWPAGES(old), pages);
+    int n = BOOKPAGES(cap);
+    cap = (n * PAGESIZE - sizeof(int) - PAGEPTRS * sizeof(void *)) / (2 * sizeof(void *));
+
+    kma_page_t *book = get_pages(n);
+    STATADD(gStats.meta_bytes, book->size - root->size);
+    void **grown = (book->ptr + sizeof(int));
+    memcpy(book->ptr, root->ptr, sizeof(int) + (PAGEPTRS + old) * sizeof(void *));
+    memset(&grown[PAGEPTRS + old], 0, (cap - old) * sizeof(void *));
+    memcpy(&grown[PAGEPTRS + cap], &freelist[PAGEUSE(freelist)], old * sizeof(void *));
+    grown[CAPACITY] = (void *) cap;
+
+    free_pages(root);
+    root = book;
 }
+#endif
+
+#ifdef KMA_THREADS
+void init_threads() {
+    pthread_key_create(&gHeapKey, retire_heap);
+}
+#endif
 
 inline int get_page_index(void *ptr) {
-    kma_page_t **freelist = (root->ptr + sizeof(int));
-    return (BASEADDR(ptr) - freelist[10]->ptr) / 8192;
+    return page_number(ptr);
 }
 
 inline int get_list_index(kma_size_t size) {
-    return 32 - __builtin_clz(size - 1) - 5;
+    return kClassOf[(size + KMA_CLASSGRAIN - 1) / KMA_CLASSGRAIN];
 }
 
 inline int size_from_index(int ndx) {
-    return 1 << (ndx + 5);
+    return kClassSizes[ndx];
 }
 
 void *kma_malloc(kma_size_t size) {
-    //return immediately for too large a request
-    if ((size + sizeof(kma_page_t * )) > PAGESIZE) return NULL;
+    //serve too large a request from a page run
+    if (ISLARGE(size)) return get_large(size);
 
     if (root == NULL) init();
 
     ++(*((int *) root->ptr)); //update used count
-    size = MAX(32, size);
+    STATADD(gStats.slack_bytes, -size);
 
     void **freelist = (root->ptr + sizeof(int));
+#ifdef KMA_THREADS
+    //our used count keeps the heap alive while the queue is freed
+    if ((long) __atomic_load_n(&freelist[QUEUED], __ATOMIC_RELAXED) >= REMOTEDRAIN) {
+        drain(freelist);
+    }
+#endif
     int ndx = get_list_index(size);
+    STATADD(gStats.classes[ndx].live, 1);
+    STATADD(gStats.classes[ndx].allocs, 1);
+    STATADD(gStats.slack_bytes, size_from_index(ndx));
 
     findFree:
     if (freelist[ndx] != NULL) {
@@ -129,18 +271,35 @@ void *kma_malloc(kma_size_t size) {
         freelist[ndx] = buffer[0];
         //update page usage count
         int i = get_page_index(buffer);
-        freelist[NUMPAGES + 10 + i] += (1 << 16);
+        freelist[PAGEUSE(freelist) + i] += (1 << 16);
         return buffer;
     }
+#ifdef KMA_THREADS
+    //take back what other threads freed before growing
+    if (freelist[REMOTE] != NULL) {
+        drain(freelist);
+        goto findFree;
+    }
+#endif
     int buffer_size = size_from_index(ndx);
     //allocate new page and update data
     kma_page_t *page = get_page();
+    STATADD(gStats.refills, 1);
     int i = get_page_index(page->ptr);
-    freelist[10 + i] = page;
-    freelist[NUMPAGES + 10 + i] = (int *) (buffer_size);
-    //initialize buffer headers
+#ifndef KMA_THREADS
+    if (i >= NUMPAGES(freelist)) {
+        grow(i + 1);
+        freelist = (root->ptr + sizeof(int));
+    }
+#endif
+    freelist[PAGEPTRS + i] = page;
+    freelist[PAGEUSE(freelist) + i] = (void *) (long) (buffer_size);
+#ifdef KMA_THREADS
+    gOwner[i] = freelist;
+#endif
+    //initialize buffer headers; the tail of the page past the last whole buffer stays unused
     void *curr_buffer;
-    void *last_buff = page->ptr - buffer_size + PAGESIZE;
+    void *last_buff = page->ptr + (PAGESIZE / buffer_size - 1) * buffer_size;
     for (curr_buffer = page->ptr; curr_buffer < last_buff; curr_buffer += buffer_size) {
         *((void **) curr_buffer) = curr_buffer + buffer_size;
     }
@@ -152,19 +311,35 @@ void *kma_malloc(kma_size_t size) {
 }
 
 void kma_free(void *ptr, kma_size_t size) {
-    size = MAX(32, size);
+    if (ISLARGE(size)) {
+        free_large(ptr, size);
+        return;
+    }
+    STATADD(gStats.slack_bytes, size);
 
-    void **buffer = ptr;
     int ndx = get_list_index(size);
-    void **freelist = (root->ptr + sizeof(int));
+    STATADD(gStats.classes[ndx].live, -1);
+    STATADD(gStats.slack_bytes, -size_from_index(ndx));
+#ifdef KMA_THREADS
+    void **owner = gOwner[get_page_index(ptr)];
+    if (root == NULL || owner != (void **) (root->ptr + sizeof(int))) {
+        remote_free(owner, ptr);
+        return;
+    }
+#endif
+    free_buffer(root->ptr + sizeof(int), ptr, ndx);
+}
+
+//put a buffer of class ndx back on a list of our heap
+void free_buffer(void **freelist, void **buffer, int ndx) {
     buffer[0] = freelist[ndx];
     freelist[ndx] = buffer;
     int i = get_page_index(buffer);
     //update page usage count
-    freelist[NUMPAGES + 10 + i] -= (1 << 16);
-    if (((int) freelist[NUMPAGES + 10 + i]) >> 16 == 0) { // unused page
+    freelist[PAGEUSE(freelist) + i] -= (1 << 16);
+    if (((long) freelist[PAGEUSE(freelist) + i]) >> 16 == 0) { // unused page
         //remove buffers from list
-        void *page = ((kma_page_t *) freelist[10 + i])->ptr;
+        void *page = ((kma_page_t *) freelist[PAGEPTRS + i])->ptr;
         buffer = &freelist[ndx];
         while (buffer != NULL) {
             void **next = *buffer;
@@ -175,21 +350,102 @@ void kma_free(void *ptr, kma_size_t size) {
             buffer = next;
         }
         //free unused page
-        free_page(freelist[10 + i]);
-        freelist[10 + i] = NULL;
+        STATADD(gStats.releases, 1);
+#ifdef KMA_THREADS
+        gOwner[i] = NULL;
+#endif
+        free_page(freelist[PAGEPTRS + i]);
+        freelist[PAGEPTRS + i] = NULL;
     }
 
     //update used pages count and release control page if everything free
     if (0 == --(*((int *) root->ptr))) {
-        void **freelist = (root->ptr + sizeof(int));
         int i;
-        for (i = NUMPAGES - 1; i > -1; --i) {
-            if (freelist[10 + i] != NULL)
-                free_page(freelist[10 + i]);
+        for (i = NUMPAGES(freelist) - 1; i > -1; --i) {
+            if (freelist[PAGEPTRS + i] != NULL) {
+                STATADD(gStats.releases, 1);
+#ifdef KMA_THREADS
+                gOwner[i] = NULL;
+#endif
+                free_page(freelist[PAGEPTRS + i]);
+            }
         }
+        STATADD(gStats.meta_bytes, -root->size);
         free_page(root);
         root = NULL;
+#ifdef KMA_THREADS
+        pthread_setspecific(gHeapKey, NULL);
+#endif
+    }
+}
+
+#ifdef KMA_THREADS
+//push a buffer on the queue of the heap that owns it; the owner only ever takes the whole queue, so there is no ABA
+void remote_free(void **owner, void **buffer) {
+    //count before pushing: once pushed the owner may drain the buffer and tear the heap down
+    __atomic_add_fetch((long *) &owner[QUEUED], 1, __ATOMIC_RELAXED);
+    void *head = __atomic_load_n(&owner[REMOTE], __ATOMIC_RELAXED);
+    do {
+        buffer[0] = head;
+    } while (!__atomic_compare_exchange_n(&owner[REMOTE], &head, buffer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+//free everything other threads queued for our heap, in one batch
+void drain(void **freelist) {
+    void **buffer = __atomic_exchange_n(&freelist[REMOTE], NULL, __ATOMIC_ACQUIRE);
+    //uncount the batch first, freeing its last buffer may tear the heap down
+    long n = 0;
+    void **b;
+    for (b = buffer; b != NULL; b = b[0]) {
+        n++;
+    }
+    __atomic_sub_fetch((long *) &freelist[QUEUED], n, __ATOMIC_RELAXED);
+    while (buffer != NULL) {
+        void **next = buffer[0];
+        //the class comes from the buffer size kept with the page usage
+        int i = get_page_index(buffer);
+        free_buffer(freelist, buffer, get_list_index((long) freelist[PAGEUSE(freelist) + i] & 0xffff));
+        buffer = next;
+    }
+}
+
+//thread exit: keep a heap that still has live buffers for the next new thread
+void retire_heap(void *heap) {
+    root = heap;
+    void **freelist = (root->ptr + sizeof(int));
+    drain(freelist);
+    if (root != NULL) {
+        pthread_mutex_lock(&gOrphansLock);
+        freelist[NEXT] = gOrphans;
+        gOrphans = freelist;
+        pthread_mutex_unlock(&gOrphansLock);
+        root = NULL;
+    }
+}
+#endif
+
+#ifdef KMA_STATS
+kma_stat_t *kma_stats() {
+    static kma_stat_t stats;
+
+    memcpy(&stats, &gStats, sizeof(kma_stat_t));
+    stats.num_classes = KMA_CLASSES;
+    int i;
+    for (i = 0; i < KMA_CLASSES; i++) {
+        stats.classes[i].size = size_from_index(i);
+        stats.classes[i].free = 0;
+    }
+    if (root != NULL) {
+        void **freelist = (root->ptr + sizeof(int));
+        for (i = 0; i < KMA_CLASSES; i++) {
+            void **buffer;
+            for (buffer = freelist[i]; buffer != NULL; buffer = buffer[0]) {
+                stats.classes[i].free++;
+            }
+        }
     }
+    return &stats;
 }
+#endif
 
 #endif // KMA_MCK2
@@ -44,15 +44,29 @@
 
 #ifdef KMA_P2FL
 #define __KMA_IMPL__
-#define MAX(a, b) (((a)>(b))?(a):(b))
+//the classes of kma_classes.h below the page size have a list, whole pages use the dummy system
+#define LISTS (KMA_CLASSES - 1)
+//bookkeeping page: used count, list heads, then the stack of pages taken for the lists. Its
+//slots are the rest of the page at first; when they are full the stack moves, by copying, to
+//a run with room for a quarter more (GROWPAGES), so it only grows with the pages in use
+#define TOP LISTS //freelist index of the last page pointer
+#define BOTTOM (LISTS + 1) //freelist index of the slot below the first page pointer
+#define END (LISTS + 2) //freelist index of one past the last slot
+#define TABLE (LISTS + 3) //freelist index of the run holding the stack, NULL while in this page
+#define SLOTS (LISTS + 4) //freelist index of the slots in this page
 
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_classes.h"
+#if KMA_CLASSES < 2
+#error "kma_classes.h needs a class below the page sized one"
+#endif
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -64,9 +78,15 @@
 /************Global Variables*********************************************/
 kma_page_t *root = NULL;
 
+//size classes and the class of every request size, see kma_classes.h
+const int kClassSizes[KMA_CLASSES] = KMA_CLASS_SIZES;
+const unsigned char kClassOf[PAGESIZE / KMA_CLASSGRAIN + 1] = KMA_CLASS_OF;
+
 /************Function Prototypes******************************************/
 void init();
 
+void grow();
+
 inline int get_list_index(kma_size_t);
 
 inline int size_from_index(int);
@@ -79,40 +99,61 @@ void *dummy_alloc();
 /**************Implementation***********************************************/
 void *dummy_alloc() {
     kma_page_t *page = get_page();
+    STAT(gStats.refills++);
     *((kma_page_t **) page->ptr) = page;
     return page->ptr + sizeof(kma_page_t * );
 }
 
 void dummy_free(void *ptr) {
     kma_page_t *page = *((kma_page_t **) BASEADDR(ptr));
+    STAT(gStats.releases++);
     free_page(page);
 }
 
 void init() {
     //fetch a page and initialize our bookkeeping
     root = get_page();
+    STAT(gStats.meta_bytes += root->size);
     *((int *) root->ptr) = 0; //track number of allocated buffers
     void **freelist = (root->ptr + sizeof(int));
-    freelist[0] = NULL; //size 32 list head
-    freelist[1] = NULL; //size 64 list head
-    freelist[2] = NULL; //size 128 list head
-    freelist[3] = NULL; //size 256 list head
-    freelist[4] = NULL; //size 512 list head
-    freelist[5] = NULL; //size 1024 list head
-    freelist[6] = NULL; //size 2048 list head
-    freelist[7] = NULL; //size 4096 list head
-    freelist[8] = &freelist[8]; //pointer to last element of our kma_page array
+    int i;
+    for (i = 0; i < LISTS; i++) {
+        freelist[i] = NULL; //list head of size class i
+    }
+    freelist[BOTTOM] = &freelist[SLOTS - 1];
+    freelist[TOP] = freelist[BOTTOM]; //the stack is empty
+    freelist[END] = &freelist[(PAGESIZE - sizeof(int)) / sizeof(void *)];
+    freelist[TABLE] = NULL;
+}
+
+//move the stack of pages to a run with room for a quarter more
+void grow() {
+    void **freelist = (root->ptr + sizeof(int));
+    long old = (freelist[END] - freelist[BOTTOM]) / sizeof(void *) - 1;
+    long used = (freelist[TOP] - freelist[BOTTOM]) / sizeof(void *);
+    //the first slot of the run stays below the bottom
+    kma_page_t *table = get_pages((int) (((GROWPAGES(old) + 1) * sizeof(void *) + PAGESIZE - 1) / PAGESIZE));
+    STAT(gStats.meta_bytes += table->size);
+    memcpy(table->ptr + sizeof(void *), freelist[BOTTOM] + sizeof(void *), used * sizeof(void *));
+    if (freelist[TABLE] != NULL) {
+        STAT(gStats.meta_bytes -= ((kma_page_t *) freelist[TABLE])->size);
+        free_pages(freelist[TABLE]);
+    }
+    freelist[TABLE] = table;
+    freelist[BOTTOM] = table->ptr;
+    freelist[TOP] = table->ptr + used * sizeof(void *);
+    freelist[END] = table->ptr + table->size;
 }
 
 inline int get_list_index(kma_size_t size) {
-    return 32 - __builtin_clz(size - 1) - 5;
+    return kClassOf[(size + KMA_CLASSGRAIN - 1) / KMA_CLASSGRAIN];
 }
 
 inline int size_from_index(int ndx) {
-    return 1 << (ndx + 5);
+    return kClassSizes[ndx];
 }
 
-/*test index function
+/*test index function, with the powers of two
 assert(get_list_index(17) == 0);
 assert(get_list_index(31) == 0);
 assert(get_list_index(32) == 0);
@@ -129,18 +170,28 @@ assert(get_list_index(4096) == 7);
 */
 
 void *kma_malloc(kma_size_t size) {
-    //return immediately for too large a request
-    if ((size + sizeof(kma_page_t * )) > PAGESIZE) return NULL;
+    //serve too large a request from a page run
+    if (ISLARGE(size)) return get_large(size);
 
     if (root == NULL) init();
 
     ++(*((int *) root->ptr)); //update used count
-    size += 4;
-    size = MAX(32, size);
+    //the header is metadata, the rest of the buffer beyond the request is slack
+    STAT(gStats.meta_bytes += sizeof(void *));
+    STAT(gStats.slack_bytes -= size + sizeof(void *));
+    size += sizeof(void *); //room for the free list head pointer
 
-    if (size > 4096) return dummy_alloc(); // whole page requests simplify to using the dummy system
+    if (size > size_from_index(LISTS - 1)) {
+        STAT(gStats.classes[LISTS].live++);
+        STAT(gStats.classes[LISTS].allocs++);
+        STAT(gStats.slack_bytes += PAGESIZE);
+        return dummy_alloc(); // whole page requests simplify to using the dummy system
+    }
     void **freelist = (root->ptr + sizeof(int));
     int ndx = get_list_index(size);
+    STAT(gStats.classes[ndx].live++);
+    STAT(gStats.classes[ndx].allocs++);
+    STAT(gStats.slack_bytes += size_from_index(ndx));
 
     findFree:
     if (freelist[ndx] != NULL) {
@@ -151,13 +202,14 @@ void *kma_malloc(kma_size_t size) {
     }
     //setup a new page and add to page array. each page has the same size buffers
     kma_page_t *page = get_page();
-    freelist[8] += sizeof(kma_page_t * );
-    //assert(freelist[8] < root->ptr + PAGESIZE);//did not have enough space to store pages
-    *((kma_page_t * *)(freelist[8])) = page;
-    //initialize buffer headers
+    STAT(gStats.refills++);
+    if (freelist[TOP] + sizeof(kma_page_t *) == freelist[END]) grow();
+    freelist[TOP] += sizeof(kma_page_t * );
+    *((kma_page_t * *)(freelist[TOP])) = page;
+    //initialize buffer headers; the tail of the page past the last whole buffer stays unused
     int buffer_size = size_from_index(ndx);
     void *curr_buffer;
-    void *last_buff = page->ptr - buffer_size + PAGESIZE;
+    void *last_buff = page->ptr + (PAGESIZE / buffer_size - 1) * buffer_size;
     for (curr_buffer = page->ptr; curr_buffer < last_buff; curr_buffer += buffer_size) {
         *((void **) curr_buffer) = curr_buffer + buffer_size;
     }
@@ -169,12 +221,22 @@ void *kma_malloc(kma_size_t size) {
 }
 
 void kma_free(void *ptr, kma_size_t size) {
-    size += 4;
-    size = MAX(32, size);
+    if (ISLARGE(size)) {
+        free_large(ptr, size);
+        return;
+    }
+    STAT(gStats.meta_bytes -= sizeof(void *));
+    STAT(gStats.slack_bytes += size + sizeof(void *));
+    size += sizeof(void *);
 
-    if (size > 4096)
+    if (size > size_from_index(LISTS - 1)) {
+        STAT(gStats.classes[LISTS].live--);
+        STAT(gStats.slack_bytes -= PAGESIZE);
         dummy_free(ptr);
+    }
     else {
+        STAT(gStats.classes[get_list_index(size)].live--);
+        STAT(gStats.slack_bytes -= size_from_index(get_list_index(size)));
         void **buffer = ptr - sizeof(void *);
         void **freelist = buffer[0];
         buffer[0] = *freelist;
@@ -184,14 +246,45 @@ void kma_free(void *ptr, kma_size_t size) {
 
     //update used pages count and release control page if everything free
     if (0 == --(*((int *) root->ptr))) {
-        kma_page_t **freelist = (root->ptr + sizeof(int) + 8 * sizeof(void *));
-        kma_page_t **page = *(kma_page_t ***) freelist;
-        while (page != freelist) {
+        void **freelist = (root->ptr + sizeof(int));
+        kma_page_t **page = freelist[TOP];
+        while (page != freelist[BOTTOM]) {
+            STAT(gStats.releases++);
             free_page(*page);
             page -= 1;
         }
+        if (freelist[TABLE] != NULL) {
+            STAT(gStats.meta_bytes -= ((kma_page_t *) freelist[TABLE])->size);
+            free_pages(freelist[TABLE]);
+        }
+        STAT(gStats.meta_bytes -= root->size);
         free_page(root);
         root = NULL;
     }
 }
+#ifdef KMA_STATS
+kma_stat_t *kma_stats() {
+    static kma_stat_t stats;
+
+    //the last class is the whole page requests, all others have a list
+    memcpy(&stats, &gStats, sizeof(kma_stat_t));
+    stats.num_classes = KMA_CLASSES;
+    int i;
+    for (i = 0; i < KMA_CLASSES; i++) {
+        stats.classes[i].size = size_from_index(i);
+        stats.classes[i].free = 0;
+    }
+    if (root != NULL) {
+        void **freelist = (root->ptr + sizeof(int));
+        for (i = 0; i < LISTS; i++) {
+            void **buffer;
+            for (buffer = freelist[i]; buffer != NULL; buffer = buffer[0]) {
+                stats.classes[i].free++;
+            }
+        }
+    }
+    return &stats;
+}
+#endif
+
 #endif // KMA_P2FL
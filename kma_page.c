@@ -48,13 +48,22 @@
  ***************************************************************************/
 
  #define __KPAGE_IMPL__
+#define MIN(a, b) (((a)<(b))?(a):(b))
+#define MAX(a, b) (((a)>(b))?(a):(b))
 
 /************System include***********************************************/
 #include <assert.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#if defined(KMA_THREADS) || defined(KMA_PURGE_THREAD)
+#include <pthread.h>
+#endif
+#include <time.h>
+#include <unistd.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -67,16 +76,90 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+#ifdef KMA_LIB
+// built into the malloc replacement (kma_lib.c): page descriptors come
+// from glibc directly, our own malloc would come back in here
+extern void* __libc_malloc(size_t);
+extern void __libc_free(void*);
+#define malloc __libc_malloc
+#define free __libc_free
+#endif
+
+#if defined(KMA_THREADS) || defined(KMA_PURGE_THREAD)
+// the engine heaps of all threads, and the purge thread, share the pool
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCKPOOL() pthread_mutex_lock(&pool_lock)
+#define UNLOCKPOOL() pthread_mutex_unlock(&pool_lock)
+#else
+#define LOCKPOOL()
+#define UNLOCKPOOL()
+#endif
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE, 0, 0 };
 
 static void* pool = NULL;
-static void* next_free_page = NULL;
+
+// one bit per page of the pool, set while the page is in use
+#define WORDBITS ((int) (8 * sizeof(unsigned long)))
+#define MAPWORDS (MAXPAGES / WORDBITS)
+
+static unsigned long page_map[MAPWORDS];
+
+// lowest map word that may still have a free page
+static int first_free_word = 0;
+
+// one past the highest page used since the pool was last trimmed
+static int pool_top = 0;
+
+#ifdef KMA_THP
+// the huge page steps of pages in use up to which thp_bytes was read,
+// -1 once the pool was trimmed or purged
+static int thp_step = -1;
+#endif
+
+#ifndef KMA_PURGE
+// when nothing above the resident bottom was last in use (ms), 0 while
+// pages above it are in use or after the trim
+static long drained_at = 0;
+
+static long grace_ms = KMA_POOLGRACEMS;
+#endif
+
+#ifdef KMA_PURGE
+// when a page was freed (ms), 0 while it is in use, purged or untouched
+static long freed_at[MAXPAGES];
+
+// pages with a freed_at, and the time of the next purge
+static int num_dirty = 0;
+static long next_purge = 0;
+
+static long decay_ms = KMA_DECAYMS;
+#endif
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
+kma_page_t* getRun(int, bool);
+void* allocPages(int, bool);
+void freePages(void*, int);
 void initPages();
+int findFree(int);
+int findUsed(int);
+int findFreeBelow(int);
+int findUsedBelow(int);
+#ifdef KMA_THP
+long readThpBytes();
+#endif
+void markPages(int, int, bool);
+long nowMs();
+#ifdef KMA_PURGE
+void purgePages(long);
+#else
+void trimPool(long);
+#endif
+#ifdef KMA_PURGE_THREAD
+void startPurger() __attribute__((constructor));
+void* purgeThread(void*);
+#endif
 
 /************External Declaration*****************************************/
 
@@ -84,17 +167,43 @@ void initPages();
 
 kma_page_t*
 get_page()
+{
+  return get_pages(1);
+}
+
+kma_page_t*
+get_pages(int n)
+{
+  return getRun(n, FALSE);
+}
+
+// allocate a page run, large buffers are placed from the top of the pool
+// so that they do not end up between the pages of an engine
+kma_page_t*
+getRun(int n, bool fromTop)
 {
   static int id = 0;
   kma_page_t* res;
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  assert(n > 0);
   
   res = (kma_page_t*) malloc(sizeof(kma_page_t));
+  
+  LOCKPOOL();
+  kma_page_stats.num_requested += n;
+  kma_page_stats.num_in_use += n;
+  
   res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  res->size = n * kma_page_stats.page_size;
+  res->ptr = allocPages(n, fromTop);
+#if defined(KMA_PURGE) && !defined(KMA_PURGE_THREAD)
+  if (num_dirty > 0)
+    purgePages(nowMs());
+#elif !defined(KMA_PURGE)
+  if (drained_at != 0)
+    trimPool(nowMs());
+#endif
+  UNLOCKPOOL();
   
   assert(res->ptr != NULL);
   
@@ -104,87 +213,510 @@ get_page()
 void
 free_page(kma_page_t* ptr)
 {
+  free_pages(ptr);
+}
+
+void
+free_pages(kma_page_t* ptr)
+{
+  int n;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  n = ptr->size / kma_page_stats.page_size;
+  
+  LOCKPOOL();
+  assert(kma_page_stats.num_in_use >= n);
+  
+  kma_page_stats.num_freed += n;
+  kma_page_stats.num_in_use -= n;
   
-  freePage(ptr->ptr);
+  freePages(ptr->ptr, n);
+#if defined(KMA_PURGE) && !defined(KMA_PURGE_THREAD)
+  if (num_dirty > 0)
+    purgePages(nowMs());
+#elif !defined(KMA_PURGE)
+  if (drained_at != 0)
+    trimPool(nowMs());
+#endif
+  UNLOCKPOOL();
   free(ptr);
 }
 
+void*
+get_large(int size)
+{
+  kma_page_t* page;
+  
+  page = getRun(NUMPAGESFOR(size), TRUE);
+  
+  // add a pointer to the page structure at the beginning of the run
+  *((kma_page_t**)page->ptr) = page;
+  
+  STAT(gStats.large_live++);
+  STAT(gStats.refills++);
+  STAT(gStats.meta_bytes += sizeof(kma_page_t*));
+  STAT(gStats.slack_bytes += page->size - sizeof(kma_page_t*) - size);
+  
+  return page->ptr + sizeof(kma_page_t*);
+}
+
+void
+free_large(void* ptr, int size)
+{
+  kma_page_t* page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
+  
+  STAT(gStats.large_live--);
+  STAT(gStats.releases++);
+  STAT(gStats.meta_bytes -= sizeof(kma_page_t*));
+  STAT(gStats.slack_bytes -= page->size - sizeof(kma_page_t*) - size);
+  
+  free_pages(page);
+}
+
+int
+page_number(void* ptr)
+{
+  return (BASEADDR(ptr) - pool) / PAGESIZE;
+}
+
 kma_page_stat_t*
 page_stats()
 {
   static kma_page_stat_t stats;
   
+#ifdef KMA_THP
+  // read smaps only when the pages in use reach another HUGEPAGESIZE
+  // since the last read, so at most once per huge page of the pool
+  int step = kma_page_stats.num_in_use * PAGESIZE / HUGEPAGESIZE;
+  
+  if (step > thp_step)
+    {
+      thp_step = step;
+      kma_page_stats.thp_bytes = readThpBytes();
+    }
+#endif
+  
   return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
 }
 
 void*
-allocPage()
+allocPages(int n, bool fromTop)
 {
-  void* res;
+  int first, end;
   
   if (pool == NULL)
     {
       initPages();
     }
   
-  res = next_free_page;
-  
-  if (res == NULL)
+  if (fromTop)
     {
+      // last fit: walk the free runs downwards from the end of the pool
+      end = findFreeBelow(MAXPAGES);
+      while (end - n >= 0)
+	{
+	  first = findUsedBelow(end);
+	  if (end - first >= n)
+	    {
+	      markPages(end - n, n, TRUE);
+	      return pool + (end - n) * PAGESIZE;
+	    }
+	  end = findFreeBelow(first);
+	}
+      
       error("error: all pages already allocated", "");
+      return NULL;
     }
   
-  next_free_page = *((void**)next_free_page);
-  
-  assert(res != NULL);
+  // first fit: walk the free runs of the page map until one is long enough
+  first = findFree(first_free_word * WORDBITS);
+  while (first + n <= MAXPAGES)
+    {
+      end = findUsed(first);
+      if (end - first >= n)
+	{
+	  markPages(first, n, TRUE);
+	  return pool + first * PAGESIZE;
+	}
+      first = findFree(end);
+    }
   
-  return res;
+  error("error: all pages already allocated", "");
+  return NULL;
 }
 
 void
-freePage(void* ptr)
+freePages(void* ptr, int n)
 {
+  int first;
+  
   assert(ptr != NULL);
+  assert(((long) ptr - (long) pool) % PAGESIZE == 0);
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  first = (ptr - pool) / PAGESIZE;
+  assert(first >= 0 && first + n <= MAXPAGES);
   
-  if (kma_page_stats.num_in_use == 0)
-    {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
-    }
+  markPages(first, n, FALSE);
+  
+#ifndef KMA_PURGE
+  // the last page above the resident bottom went: the grace period starts
+  if (first + n > KMA_POOLRESIDENT && findUsedBelow(MAXPAGES) <= KMA_POOLRESIDENT)
+    drained_at = nowMs();
+#endif
 }
 
 void
 initPages()
 {
-  int i;
-  
-  assert(next_free_page == NULL);
   assert(pool == NULL);
   
   //pool = calloc(MAXPAGES, PAGESIZE);
+#if defined(KMA_LIB) && defined(KMA_THP)
+  // map a huge page more than the pool, align the pool in it and unmap
+  // the slack at both ends
+  void* map = mmap(NULL, MAXPAGES * PAGESIZE + HUGEPAGESIZE,
+		   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    error("Error using mmap to allocate memory", "");
+  pool = (void*) (((long) map + HUGEPAGESIZE - 1) & ~(long) (HUGEPAGESIZE - 1));
+  if (pool > map)
+    munmap(map, pool - map);
+  munmap(pool + MAXPAGES * PAGESIZE, map + HUGEPAGESIZE - pool);
+  madvise(pool, MAXPAGES * PAGESIZE, MADV_HUGEPAGE);
+#elif defined(KMA_LIB)
+  pool = mmap(NULL, MAXPAGES * PAGESIZE, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pool == MAP_FAILED)
+    {
+      pool = NULL;
+      error("Error using mmap to allocate memory", "");
+    }
+#elif defined(KMA_THP)
+  int result = posix_memalign(&pool, HUGEPAGESIZE, MAXPAGES * PAGESIZE);
+  if(result)
+    error("Error using posix_memalign to allocate memory", "");
+  // only a hint, the pool still works with small pages if THP is off
+  madvise(pool, MAXPAGES * PAGESIZE, MADV_HUGEPAGE);
+#else
   int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
   if(result)
     error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+#endif
+  
+  memset(page_map, 0, sizeof(page_map));
+  first_free_word = 0;
+  pool_top = 0;
+  
+#ifdef KMA_PURGE
+  memset(freed_at, 0, sizeof(freed_at));
+  num_dirty = 0;
+  if (getenv("KMA_DECAY_MS") != NULL)
+    decay_ms = atol(getenv("KMA_DECAY_MS"));
+#else
+  drained_at = 0;
+  if (getenv("KMA_POOLGRACE_MS") != NULL)
+    grace_ms = atol(getenv("KMA_POOLGRACE_MS"));
+#endif
+}
+
+// index of the first free page at or after page i, MAXPAGES if none
+int
+findFree(int i)
+{
+  int w = i / WORDBITS;
+  unsigned long bits;
+  
+  if (w >= MAPWORDS)
+    return MAXPAGES;
+  
+  // ignore the pages below i in the first word
+  bits = ~page_map[w] & (~0UL << (i % WORDBITS));
+  while (bits == 0)
+    {
+      if (++w == MAPWORDS)
+	return MAXPAGES;
+      bits = ~page_map[w];
+    }
+  return w * WORDBITS + __builtin_ctzl(bits);
+}
+
+// index of the first used page at or after page i, MAXPAGES if none
+int
+findUsed(int i)
+{
+  int w = i / WORDBITS;
+  unsigned long bits;
+  
+  if (w >= MAPWORDS)
+    return MAXPAGES;
+  
+  bits = page_map[w] & (~0UL << (i % WORDBITS));
+  while (bits == 0)
+    {
+      if (++w == MAPWORDS)
+	return MAXPAGES;
+      bits = page_map[w];
+    }
+  return w * WORDBITS + __builtin_ctzl(bits);
+}
+
+// one past the last free page below page i, 0 if none
+int
+findFreeBelow(int i)
+{
+  int w;
+  unsigned long bits;
+  
+  if (i <= 0)
+    return 0;
+  
+  // ignore the pages at or above i in the last word
+  w = (i - 1) / WORDBITS;
+  bits = ~page_map[w] & (~0UL >> (WORDBITS - 1 - (i - 1) % WORDBITS));
+  while (bits == 0)
+    {
+      if (w-- == 0)
+	return 0;
+      bits = ~page_map[w];
+    }
+  return w * WORDBITS + (WORDBITS - __builtin_clzl(bits));
+}
+
+// one past the last used page below page i, 0 if none
+int
+findUsedBelow(int i)
+{
+  int w;
+  unsigned long bits;
+  
+  if (i <= 0)
+    return 0;
+  
+  w = (i - 1) / WORDBITS;
+  bits = page_map[w] & (~0UL >> (WORDBITS - 1 - (i - 1) % WORDBITS));
+  while (bits == 0)
+    {
+      if (w-- == 0)
+	return 0;
+      bits = page_map[w];
+    }
+  return w * WORDBITS + (WORDBITS - __builtin_clzl(bits));
+}
+
+#ifdef KMA_THP
+// bytes of the pool backed by huge pages, from smaps: each mapping counts
+// its AnonHugePages, but no more than its overlap with the pool. Read with
+// open/read, as stdio would allocate and could come back into the library
+long
+readThpBytes()
+{
+  char buf[4096];
+  unsigned long lo = (unsigned long) pool;
+  unsigned long hi = lo + (unsigned long) MAXPAGES * PAGESIZE;
+  unsigned long start, end, kb, overlap = 0;
+  long res = 0;
+  int fd, len = 0, n;
+  char *line, *eol;
+  
+  if (pool == NULL || (fd = open("/proc/self/smaps", O_RDONLY)) < 0)
+    return 0;
+  
+  while ((n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+    {
+      len += n;
+      buf[len] = '\0';
+      for (line = buf; (eol = strchr(line, '\n')) != NULL; line = eol + 1)
+	{
+	  *eol = '\0';
+	  if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+	    {
+	      overlap = start < hi && end > lo ? MIN(end, hi) - MAX(start, lo) : 0;
+	    }
+	  else if (overlap > 0 && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+	    {
+	      res += MIN(kb * 1024, overlap);
+	    }
+	}
+      // keep the partial last line for the next read
+      len -= line - buf;
+      memmove(buf, line, len);
+    }
+  close(fd);
+  
+  return res;
+}
+#endif
+
+// set or clear the map bits of pages [first, first + n)
+void
+markPages(int first, int n, bool used)
+{
+  int w = first / WORDBITS;
+  int bit = first % WORDBITS;
+  int n0 = n;
+  
+  while (n > 0)
+    {
+      int len = MIN(n, WORDBITS - bit);
+      unsigned long mask = (len == WORDBITS) ? ~0UL : (((1UL << len) - 1) << bit);
+      
+      if (used)
+	{
+	  assert((page_map[w] & mask) == 0);
+	  page_map[w] |= mask;
+	}
+      else
+	{
+	  assert((page_map[w] & mask) == mask);
+	  page_map[w] &= ~mask;
+	}
+      
+      n -= len;
+      bit = 0;
+      w++;
+    }
+  
+  if (used && first + n0 > pool_top)
+    pool_top = first + n0;
+#ifndef KMA_PURGE
+  if (used && first + n0 > KMA_POOLRESIDENT)
+    drained_at = 0;
+#endif
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+#ifdef KMA_PURGE
+  // a free page starts to decay, a reused one no longer needs purging
+  if (used)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      for (w = first; w < first + n0; w++)
+	{
+	  if (freed_at[w] != 0)
+	    {
+	      freed_at[w] = 0;
+	      num_dirty--;
+	    }
+	}
+    }
+  else if (decay_ms >= 0)
+    {
+      long now = nowMs();
       
-      *((void**) ptr) = next;
+      for (w = first; w < first + n0; w++)
+	freed_at[w] = now;
+      num_dirty += n0;
+    }
+#endif
+  
+  // keep the search hint on the lowest word that may have a free page
+  w = first / WORDBITS;
+  if (!used && w < first_free_word)
+    {
+      first_free_word = w;
+    }
+  while (first_free_word < MAPWORDS && page_map[first_free_word] == ~0UL)
+    {
+      first_free_word++;
+    }
+}
+
+// coarse monotonic clock in ms, the decay and grace times need no better
+long
+nowMs()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000 + 1;
+}
+
+#ifndef KMA_PURGE
+// keep the pool, but not more of it resident than the bottom once nothing
+// above it has been in use for the grace period
+void
+trimPool(long now)
+{
+  if (grace_ms < 0 || now - drained_at < grace_ms)
+    return;
+  drained_at = 0;
+  if (pool_top > KMA_POOLRESIDENT)
+    {
+      madvise(pool + KMA_POOLRESIDENT * PAGESIZE,
+	      (pool_top - KMA_POOLRESIDENT) * PAGESIZE, MADV_DONTNEED);
+      pool_top = KMA_POOLRESIDENT;
+#ifdef KMA_THP
+      thp_step = -1;
+#endif
     }
+}
+#else
+// give the pages free since before now - decay_ms back to the kernel, in
+// runs of contiguous pages; does nothing until the next purge is due
+void
+purgePages(long now)
+{
+  int first, end;
+  long cutoff = now - decay_ms;
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  if (pool == NULL || decay_ms < 0 || now < next_purge)
+    return;
+  next_purge = now + MAX(decay_ms / 4, 1);
+  
+  // a pool with nothing in use above its bottom keeps the bottom resident
+  first = findUsedBelow(MAXPAGES) <= KMA_POOLRESIDENT ? KMA_POOLRESIDENT : 0;
+  for (; first < MAXPAGES && num_dirty > 0; first = end + 1)
+    {
+      if (freed_at[first] == 0 || freed_at[first] > cutoff)
+	{
+	  end = first;
+	  continue;
+	}
+      for (end = first; end < MAXPAGES && freed_at[end] != 0
+	     && freed_at[end] <= cutoff; end++)
+	{
+	  freed_at[end] = 0;
+	}
+      num_dirty -= end - first;
+      kma_page_stats.num_purged += end - first;
+      madvise(pool + first * PAGESIZE, (end - first) * PAGESIZE, KMA_PURGEADVICE);
+#ifdef KMA_THP
+      thp_step = -1;
+#endif
+    }
+}
+#endif
+
+#ifdef KMA_PURGE_THREAD
+// started at load time: pthread_create may call malloc, which must not
+// find the malloc replacement (kma_lib.c) in the middle of a call
+void
+startPurger()
+{
+  pthread_t thread;
+  
+  if (pthread_create(&thread, NULL, purgeThread, NULL) == 0)
+    pthread_detach(thread);
+}
+
+// purges four times per decay time, so pages go at most 25% late
+void*
+purgeThread(void* arg)
+{
+  struct timespec ts;
+  long sleep;
+  
+  while (TRUE)
+    {
+      sleep = MAX(decay_ms / 4, 1);
+      ts.tv_sec = sleep / 1000;
+      ts.tv_nsec = sleep % 1000 * 1000000;
+      nanosleep(&ts, NULL);
+      
+      LOCKPOOL();
+      if (num_dirty > 0)
+	purgePages(nowMs());
+      UNLOCKPOOL();
+    }
+  return NULL;
 }
+#endif
@@ -75,6 +75,46 @@
 
 #define MAXPAGES 4096
 
+/*  With KMA_THP defined the pool is aligned to HUGEPAGESIZE and advised
+ *  with MADV_HUGEPAGE, so the kernel can back it with transparent huge
+ *  pages and the pages of the pool share far fewer TLB entries.
+ */
+#define HUGEPAGESIZE (2 * 1024 * 1024)
+
+/*  With KMA_PURGE a page that stays free for KMA_DECAYMS milliseconds
+ *  (or $KMA_DECAY_MS, read when the pool is created) is given back to
+ *  the kernel with madvise(KMA_PURGEADVICE) while the pool stays mapped.
+ *  Expired pages are purged by the page calls, at most four times per
+ *  decay time, or with KMA_PURGE_THREAD by a background thread instead.
+ *  MADV_DONTNEED drops the pages from the RSS at once; MADV_FREE is
+ *  cheaper but only takes them when the kernel is short of memory.
+ */
+#ifndef KMA_DECAYMS
+#define KMA_DECAYMS 1000
+#endif
+#ifndef KMA_PURGEADVICE
+#define KMA_PURGEADVICE MADV_DONTNEED
+#endif
+#if defined(KMA_PURGE_THREAD) && !defined(KMA_PURGE)
+#define KMA_PURGE
+#endif
+
+/*  The pool is created on the first request and then kept. Once nothing
+ *  above its lowest KMA_POOLRESIDENT pages (which hold the engines'
+ *  bookkeeping, taken first fit) has been in use for KMA_POOLGRACEMS
+ *  milliseconds (or $KMA_POOLGRACE_MS, read when the pool is created;
+ *  negative keeps them), the next page call gives the pages above them
+ *  back to the kernel with madvise. With KMA_PURGE the decay time is the
+ *  grace period instead. A workload that drains and refills within it
+ *  finds its pages resident.
+ */
+#ifndef KMA_POOLRESIDENT
+#define KMA_POOLRESIDENT 256
+#endif
+#ifndef KMA_POOLGRACEMS
+#define KMA_POOLGRACEMS 1000
+#endif
+
 /***********************************************************************
  *  Title: Base Address Macro
  * ---------------------------------------------------------------------
@@ -85,6 +125,39 @@
  ***********************************************************************/
 #define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
 
+/***********************************************************************
+ *  Title: Large Request Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Check whether a request does not fit into a single page
+ *             (together with the page structure pointer) and has to
+ *             be served from a run of contiguous pages
+ *    Input: the request size
+ *    Output: TRUE if the request needs a page run
+ ***********************************************************************/
+#define ISLARGE(size) (((size) + sizeof(kma_page_t*)) > PAGESIZE)
+
+/***********************************************************************
+ *  Title: Page Count Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Number of pages needed for a large request including
+ *             the page structure pointer at the start of the run
+ *    Input: the request size
+ *    Output: the number of contiguous pages
+ ***********************************************************************/
+#define NUMPAGESFOR(size) \
+  ((int) (((size) + sizeof(kma_page_t*) + PAGESIZE - 1) / PAGESIZE))
+
+/***********************************************************************
+ *  Title: Table Growth Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Number of pool pages an engine's bookkeeping tables grow
+ *             to cover when a page lies beyond them; a quarter more,
+ *             so the unused part of a table stays small
+ *    Input: the number of pool pages covered
+ *    Output: the number of pool pages to cover
+ ***********************************************************************/
+#define GROWPAGES(n) ((n) + (n) / 4)
+
 typedef struct
 {
   int id;
@@ -98,6 +171,8 @@ typedef struct
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_purged; // free pages given back to the kernel (KMA_PURGE)
+  long thp_bytes; // bytes of the pool backed by huge pages (KMA_THP)
 } kma_page_stat_t;
 
 /************Global Variables*********************************************/
@@ -113,6 +188,17 @@ typedef struct
  ***********************************************************************/
 EXTERN kma_page_t* get_page();
 
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a run of n contiguous memory pages; the run is
+ *             described by a single page structure whose size is
+ *             n * PAGESIZE
+ *    Input: the number of pages
+ *    Output: the allocated page run
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int n);
+
 /***********************************************************************
  *  Title: Releases a memory page 
  * ---------------------------------------------------------------------
@@ -122,10 +208,53 @@ EXTERN kma_page_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Releases contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run of pages returned by get_pages()
+ *    Input: the pointer to the page run structure
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t*);
+
+/***********************************************************************
+ *  Title: Allocates a large buffer
+ * ---------------------------------------------------------------------
+ *    Purpose: Serves a request that does not fit into a single page
+ *             from a page run. The page structure pointer is stored at
+ *             the start of the run, like the dummy allocator does.
+ *    Input: the request size
+ *    Output: the allocated buffer
+ ***********************************************************************/
+EXTERN void* get_large(int size);
+
+/***********************************************************************
+ *  Title: Releases a large buffer
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a buffer returned by get_large()
+ *    Input: the pointer to the buffer, the size of the request
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_large(void*, int size);
+
+/***********************************************************************
+ *  Title: Page number
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the number of the page a pointer lies in, counted
+ *             from the start of the pool
+ *    Input: a pointer into a page in use
+ *    Output: the page number, 0 to MAXPAGES - 1
+ ***********************************************************************/
+EXTERN int page_number(void*);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
- *    Purpose: Get the memory page statistics
+ *    Purpose: Get the memory page statistics. With KMA_THP the huge
+ *             page coverage is read from /proc/self/smaps whenever the
+ *             pages in use reach another HUGEPAGESIZE since the last
+ *             read or since the pool was trimmed; in between it keeps
+ *             the last value read
  *    Input: none 
  *    Output: the memory page statistics in a static buffer
  ***********************************************************************/
@@ -0,0 +1,398 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Per-CPU buffer caches in front of a kma engine
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: jlx979, rgp633
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *  Built with KMA_PERCPU, for the malloc replacement (kma_lib.c) of a
+ *  size class engine, e.g.
+ *
+ *    make lib LIBENGINE=KMA_MCK2 OPTS=-DKMA_PERCPU
+ *
+ *  The engine's kma_malloc and kma_free are renamed to engine_malloc and
+ *  engine_free (see kma.h) and called under one lock. In front of them
+ *  every CPU keeps a small stack of free buffers per size class of
+ *  kma_classes.h. A request is rounded up to its class and popped from
+ *  the stack of the CPU it runs on; a free is pushed there. Only misses,
+ *  frees to a full stack and requests of the page sized class or larger
+ *  take the engine lock. What is cached is bounded by CACHEBYTES per
+ *  class and CPU, however many threads there are.
+ *
+ *  On x86-64 Linux with a glibc that registers restartable sequences
+ *  (2.35 and later), push and pop are rseq critical sections: they read
+ *  the current CPU, and end in a single store that commits the new stack
+ *  count. If the thread is preempted, migrated or signalled before the
+ *  commit, the kernel restarts it at the abort handler, so neither needs
+ *  an atomic instruction or a lock. Elsewhere every CPU's stacks have a
+ *  lock, taken on the CPU that sched_getcpu() reports.
+ *
+ *  Cached buffers stay allocated in the engine; kma_flush() gives them
+ *  back when no other thread is allocating, e.g. at the end of a trace.
+ ***************************************************************************/
+
+#ifdef KMA_PERCPU
+#define __KMA_PERCPU_IMPL__
+#define _GNU_SOURCE
+
+#ifdef KMA_THREADS
+#error "KMA_PERCPU and KMA_THREADS are alternatives"
+#endif
+
+/************System include***********************************************/
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ
+#endif
+#endif
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_classes.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// buffers a stack holds at most, and bytes it may cache
+#define CACHESLOTS 32
+#define CACHEBYTES (32 * 1024)
+
+// the stacks of one CPU, on cache lines of their own
+typedef struct
+{
+  long count[KMA_CLASSES];
+  void* slots[KMA_CLASSES][CACHESLOTS];
+  pthread_mutex_t lock;		// without rseq only
+} __attribute__((aligned(64))) cache_t;
+
+/************Global Variables*********************************************/
+
+static const int kCacheSizes[KMA_CLASSES] = KMA_CLASS_SIZES;
+static const unsigned char kCacheClassOf[PAGESIZE / KMA_CLASSGRAIN + 1] = KMA_CLASS_OF;
+
+static cache_t* gCaches = NULL;
+static int gNumCpus = 0;
+
+// buffers a stack of each class may hold
+static long gLimit[KMA_CLASSES];
+
+static bool gRseq = FALSE;
+
+static pthread_once_t gOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t gEngineLock = PTHREAD_MUTEX_INITIALIZER;
+
+/************Function Prototypes******************************************/
+void* engine_malloc(kma_size_t);
+void engine_free(void*, kma_size_t);
+
+static void initCaches();
+static int classOf(kma_size_t);
+static bool push(int, void*);
+static void* pop(int);
+static cache_t* lockedCache();
+#ifdef HAVE_RSEQ
+static int rseqPush(int, void*);
+static int rseqPop(int, void**);
+#endif
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  int ndx;
+  void* ptr;
+
+  if (gCaches == NULL)
+    pthread_once(&gOnce, initCaches);
+
+  // the page sized class would be a page run in the engine
+  ndx = classOf(size);
+  if (ndx < 0)
+    {
+      pthread_mutex_lock(&gEngineLock);
+      ptr = engine_malloc(size);
+      pthread_mutex_unlock(&gEngineLock);
+      return ptr;
+    }
+
+  ptr = pop(ndx);
+  if (ptr != NULL)
+    return ptr;
+
+  pthread_mutex_lock(&gEngineLock);
+  ptr = engine_malloc(kCacheSizes[ndx]);
+  pthread_mutex_unlock(&gEngineLock);
+  return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  int ndx = classOf(size);
+
+  if (ndx >= 0 && push(ndx, ptr))
+    return;
+
+  pthread_mutex_lock(&gEngineLock);
+  engine_free(ptr, ndx < 0 ? size : kCacheSizes[ndx]);
+  pthread_mutex_unlock(&gEngineLock);
+}
+
+void
+kma_flush()
+{
+  int cpu, ndx;
+
+  if (gCaches == NULL)
+    return;
+
+  pthread_mutex_lock(&gEngineLock);
+  for (cpu = 0; cpu < gNumCpus; cpu++)
+    {
+      for (ndx = 0; ndx < KMA_CLASSES; ndx++)
+	{
+	  while (gCaches[cpu].count[ndx] > 0)
+	    {
+	      engine_free(gCaches[cpu].slots[ndx][--gCaches[cpu].count[ndx]],
+			  kCacheSizes[ndx]);
+	    }
+	}
+    }
+  pthread_mutex_unlock(&gEngineLock);
+}
+
+static void
+initCaches()
+{
+  int i;
+  cache_t* caches;
+
+  gNumCpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (gNumCpus < 1)
+    gNumCpus = 1;
+
+  // mapped, so that a malloc replacement does not come back in here
+  caches = mmap(NULL, gNumCpus * sizeof(cache_t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (caches == MAP_FAILED)
+    error("Error using mmap to allocate the per-CPU caches", "");
+  for (i = 0; i < gNumCpus; i++)
+    pthread_mutex_init(&caches[i].lock, NULL);
+
+  for (i = 0; i < KMA_CLASSES; i++)
+    {
+      gLimit[i] = CACHEBYTES / kCacheSizes[i];
+      if (gLimit[i] > CACHESLOTS)
+	gLimit[i] = CACHESLOTS;
+      if (gLimit[i] < 1)
+	gLimit[i] = 1;
+    }
+
+#ifdef HAVE_RSEQ
+  gRseq = __rseq_size > 0;
+#endif
+
+  gCaches = caches;
+}
+
+// the cached class of a request, -1 for those that bypass the caches
+static int
+classOf(kma_size_t size)
+{
+  int ndx;
+
+  if (ISLARGE(size))
+    return -1;
+  ndx = kCacheClassOf[(size + KMA_CLASSGRAIN - 1) / KMA_CLASSGRAIN];
+  return ISLARGE(kCacheSizes[ndx]) ? -1 : ndx;
+}
+
+static bool
+push(int ndx, void* ptr)
+{
+  cache_t* cache;
+  bool pushed = FALSE;
+
+#ifdef HAVE_RSEQ
+  if (gRseq)
+    {
+      int result;
+
+      while ((result = rseqPush(ndx, ptr)) < 0)
+	;
+      return result;
+    }
+#endif
+
+  cache = lockedCache();
+  if (cache->count[ndx] < gLimit[ndx])
+    {
+      cache->slots[ndx][cache->count[ndx]++] = ptr;
+      pushed = TRUE;
+    }
+  pthread_mutex_unlock(&cache->lock);
+  return pushed;
+}
+
+static void*
+pop(int ndx)
+{
+  cache_t* cache;
+  void* ptr = NULL;
+
+#ifdef HAVE_RSEQ
+  if (gRseq)
+    {
+      int result;
+
+      while ((result = rseqPop(ndx, &ptr)) < 0)
+	;
+      return result ? ptr : NULL;
+    }
+#endif
+
+  cache = lockedCache();
+  if (cache->count[ndx] > 0)
+    ptr = cache->slots[ndx][--cache->count[ndx]];
+  pthread_mutex_unlock(&cache->lock);
+  return ptr;
+}
+
+// the stacks of the CPU we run on, locked
+static cache_t*
+lockedCache()
+{
+  int cpu = sched_getcpu();
+  cache_t* cache = &gCaches[cpu >= 0 ? cpu % gNumCpus : 0];
+
+  pthread_mutex_lock(&cache->lock);
+  return cache;
+}
+
+#ifdef HAVE_RSEQ
+/*  Both critical sections run from label 1 to the commit store that
+ *  ends at label 2. The descriptor (3) tells the kernel where they are
+ *  and where to restart (4); the abort handler is preceded by RSEQ_SIG,
+ *  encoded as the operand of a ud1 like librseq does, and returns -1 so
+ *  that the caller retries. A full or empty stack leaves the section
+ *  before the commit, which the kernel ignores.
+ */
+#define RSEQAREA() ((char*) __builtin_thread_pointer() + __rseq_offset)
+
+#define RSEQSECTION							\
+  ".pushsection __rseq_cs, \"aw\"\n\t"					\
+  ".balign 32\n\t"							\
+  "3:\n\t"								\
+  ".long 0, 0\n\t"							\
+  ".quad 1f, 2f - 1f, 4f\n\t"						\
+  ".popsection\n\t"							\
+  "leaq 3b(%%rip), %%rax\n\t"						\
+  "movq %%rax, %c[cs](%[rs])\n\t"
+
+#define RSEQABORT							\
+  ".pushsection __rseq_failure, \"ax\"\n\t"				\
+  ".byte 0x0f, 0xb9, 0x3d\n\t"						\
+  ".long 0x53053053\n\t"						\
+  "4:\n\t"								\
+  "jmp %l[abort]\n\t"							\
+  ".popsection\n\t"
+
+// 1 if pushed, 0 if the stack is full, -1 if restarted
+static int
+rseqPush(int ndx, void* ptr)
+{
+  __asm__ __volatile__ goto (RSEQSECTION
+			     "1:\n\t"
+			     "movl %c[cpu](%[rs]), %%eax\n\t"
+			     "imulq %[stride], %%rax, %%rax\n\t"
+			     "addq %[base], %%rax\n\t"
+			     "movq (%%rax,%[ndx],8), %%rdx\n\t"
+			     "cmpq %[limit], %%rdx\n\t"
+			     "jae %l[full]\n\t"
+			     "imulq %[slots], %[ndx], %%rcx\n\t"
+			     "addq %%rdx, %%rcx\n\t"
+			     "movq %[ptr], %c[slotoff](%%rax,%%rcx,8)\n\t"
+			     "incq %%rdx\n\t"
+			     "movq %%rdx, (%%rax,%[ndx],8)\n\t"
+			     "2:\n\t"
+			     RSEQABORT
+			     :
+			     : [rs] "r" (RSEQAREA()), [base] "r" (gCaches),
+			       [ndx] "r" ((long) ndx), [limit] "r" (gLimit[ndx]),
+			       [ptr] "r" (ptr),
+			       [cs] "i" (offsetof(struct rseq, rseq_cs)),
+			       [cpu] "i" (offsetof(struct rseq, cpu_id)),
+			       [stride] "i" (sizeof(cache_t)),
+			       [slots] "i" (CACHESLOTS),
+			       [slotoff] "i" (offsetof(cache_t, slots))
+			     : "rax", "rcx", "rdx", "memory", "cc"
+			     : full, abort);
+  return 1;
+ full:
+  return 0;
+ abort:
+  return -1;
+}
+
+// 1 if popped into *out, 0 if the stack is empty, -1 if restarted
+static int
+rseqPop(int ndx, void** out)
+{
+  __asm__ __volatile__ goto (RSEQSECTION
+			     "1:\n\t"
+			     "movl %c[cpu](%[rs]), %%eax\n\t"
+			     "imulq %[stride], %%rax, %%rax\n\t"
+			     "addq %[base], %%rax\n\t"
+			     "movq (%%rax,%[ndx],8), %%rdx\n\t"
+			     "testq %%rdx, %%rdx\n\t"
+			     "jz %l[empty]\n\t"
+			     "decq %%rdx\n\t"
+			     "imulq %[slots], %[ndx], %%rcx\n\t"
+			     "addq %%rdx, %%rcx\n\t"
+			     "movq %c[slotoff](%%rax,%%rcx,8), %%rcx\n\t"
+			     "movq %%rcx, (%[out])\n\t"
+			     "movq %%rdx, (%%rax,%[ndx],8)\n\t"
+			     "2:\n\t"
+			     RSEQABORT
+			     :
+			     : [rs] "r" (RSEQAREA()), [base] "r" (gCaches),
+			       [ndx] "r" ((long) ndx), [out] "r" (out),
+			       [cs] "i" (offsetof(struct rseq, rseq_cs)),
+			       [cpu] "i" (offsetof(struct rseq, cpu_id)),
+			       [stride] "i" (sizeof(cache_t)),
+			       [slots] "i" (CACHESLOTS),
+			       [slotoff] "i" (offsetof(cache_t, slots))
+			     : "rax", "rcx", "rdx", "memory", "cc"
+			     : empty, abort);
+  return 1;
+ empty:
+  return 0;
+ abort:
+  return -1;
+}
+#endif
+
+#endif // KMA_PERCPU
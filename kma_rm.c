@@ -48,6 +48,7 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -67,6 +68,10 @@ typedef struct freeList {
     struct freeList *next;
 } free_list_t;
 
+// a request that fits a page but would leave its tail too small for a free
+// list node can never be carved from a fresh page, so it gets a page run too
+#define RMLARGE(size) ((size) + sizeof(free_list_t) > PAGESIZE - sizeof(kma_page_t *))
+
 kma_page_t *root = NULL;
 
 /************Function Prototypes******************************************/
@@ -79,6 +84,7 @@ free_list_t *insert_node(free_list_t *, int);
 void init() {
     //fetch a page and initialize our free list. root->ptr is the head pointer of our list
     root = get_page();
+    STAT(gStats.meta_bytes += root->size);
     free_list_t *head = root->ptr + sizeof(free_list_t *) + sizeof(int);
     LISTHEAD = head;
     *((int *) (root->ptr + sizeof(free_list_t *))) = 0;
@@ -99,13 +105,16 @@ void checkList() {
 }
 
 void * kma_malloc(kma_size_t size) {
+    STAT(gStats.slack_bytes += MAX(sizeof(free_list_t), size) - size);
     size = MAX(sizeof(free_list_t), size); //min request size must fit our list structure
-    //return immediately for too large a request
-    if ((size + sizeof(kma_page_t * )) > PAGESIZE) return NULL;
+    //serve too large a request from a page run
+    if (RMLARGE(size)) return get_large(size);
 
     if (root == NULL) init();
 
     ++(*((int *) (root->ptr + sizeof(free_list_t *)))); //update used count
+    STAT(gStats.classes[0].live++);
+    STAT(gStats.classes[0].allocs++);
     free_list_t *buf;
 
     findFree:
@@ -116,6 +125,7 @@ void * kma_malloc(kma_size_t size) {
             return buf;
         }
         else if (buf->size >= size + sizeof(free_list_t)) {
+            STAT(gStats.splits++);
             buf->size = buf->size - size;//resize free portion and return tail chunk
             free_list_t *new_buf = ((void *) buf) + buf->size;
             return new_buf;
@@ -126,6 +136,8 @@ void * kma_malloc(kma_size_t size) {
     //add new page to list
     kma_page_t *page = get_page();
     *((kma_page_t **) page->ptr) = page;
+    STAT(gStats.refills++);
+    STAT(gStats.meta_bytes += sizeof(kma_page_t * ));
     buf = page->ptr + sizeof(kma_page_t * );
     insert_node(buf, PAGESIZE - sizeof(kma_page_t * ));
 
@@ -179,16 +191,24 @@ free_list_t *insert_node(free_list_t *addr, int size) {
 }
 
 void kma_free(void *ptr, kma_size_t size) {
+    if (RMLARGE(size)) {
+        free_large(ptr, size);
+        return;
+    }
+    STAT(gStats.classes[0].live--);
+    STAT(gStats.slack_bytes -= MAX(sizeof(free_list_t), size) - size);
     size = MAX(sizeof(free_list_t), size);
     //add node to free list and coalese
     free_list_t *node = insert_node(ptr, size);
     bool co_right = (void *) node + node->size == node->next;
     bool co_left = node->prev && (void *) node->prev + node->prev->size == node;
     if (co_right) {
+        STAT(gStats.merges++);
         node->size += node->next->size;
         remove_node(node->next);
     }
     if (co_left) {
+        STAT(gStats.merges++);
         node = node->prev;
         node->size += node->next->size;
         remove_node(node->next);
@@ -196,13 +216,35 @@ void kma_free(void *ptr, kma_size_t size) {
     //free up unused page
     if (node->size == PAGESIZE - sizeof(kma_page_t * )) {
         remove_node(node);
+        STAT(gStats.releases++);
+        STAT(gStats.meta_bytes -= sizeof(kma_page_t * ));
         free_page(*((kma_page_t **) BASEADDR(ptr)));
     }
     //update used pages count and release control page if everything free
     if (0 == --(*((int *) (root->ptr + sizeof(free_list_t *))))) {
+        STAT(gStats.meta_bytes -= root->size);
         free_page(root);
         root = NULL;
     }
 }
 
+#ifdef KMA_STATS
+kma_stat_t *kma_stats() {
+    static kma_stat_t stats;
+
+    //a single variable sized class; the free list is address ordered
+    memcpy(&stats, &gStats, sizeof(kma_stat_t));
+    stats.num_classes = 1;
+    stats.classes[0].size = 0;
+    stats.classes[0].free = 0;
+    if (root != NULL) {
+        free_list_t *buf;
+        for (buf = LISTHEAD; buf != NULL; buf = buf->next) {
+            stats.classes[0].free++;
+        }
+    }
+    return &stats;
+}
+#endif
+
 #endif // KMA_RM
\ No newline at end of file
@@ -0,0 +1,355 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Repeated in-process trace replay for timing the engines
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: jlx979, rgp633
+
+ ***************************************************************************/
+
+/***************************************************************************
+ *  Reads a trace once and replays it against the engine it is linked
+ *  with: first -w warm-up runs, then -n timed runs. Process start and
+ *  trace parsing are not part of any run. The competition ratio is taken
+ *  from one more, untimed run, with the same bookkeeping as kma.c.
+ *
+ *  Prints the mean, standard deviation, 95% confidence interval (Student
+ *  t), median and minimum of the run time, the ratio, and the score of
+ *  testsuite/run_testcase.sh, best time * (1 + ratio), as text, as a CSV
+ *  line (-f csv: engine, trace, runs, mean, stddev, ci95, median and min
+ *  in ms, ratio, score) or as a JSON object (-f json). -c pins the
+ *  process to one CPU. testsuite/run_bench.sh runs the engine x trace
+ *  matrix with these and compares it to a baseline.
+ *
+ *  usage: kma_<engine>_runner [-w warmup] [-n runs] [-c cpu]
+ *                             [-f text|csv|json] trace_file
+ ***************************************************************************/
+
+#define __KMA_TEST_IMPL__
+#define _GNU_SOURCE
+
+/************System include***********************************************/
+#include <math.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#if defined(KMA_DUMMY)
+#define ENGINE "dummy"
+#elif defined(KMA_RM)
+#define ENGINE "rm"
+#elif defined(KMA_P2FL)
+#define ENGINE "p2fl"
+#elif defined(KMA_MCK2)
+#define ENGINE "mck2"
+#elif defined(KMA_BUD)
+#define ENGINE "bud"
+#elif defined(KMA_LZBUD)
+#define ENGINE "lzbud"
+#elif defined(KMA_HYBRID)
+#define ENGINE "hybrid"
+#else
+#define ENGINE "unknown"
+#endif
+
+typedef struct
+{
+  int id;
+  int size;			// 0 for a FREE
+} op_t;
+
+/************Global Variables*********************************************/
+
+static op_t* gOps = NULL;
+static long gNumOps = 0;
+
+static void** gPtrs = NULL;
+static int* gSizes = NULL;
+
+// two-sided 97.5% quantiles of Student's t for 1..30 degrees of freedom
+static const double kStudentT[] = {
+  12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+  2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+  2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+/************Function Prototypes******************************************/
+void load(char*);
+void replay();
+double competitionRatio();
+void pin(int);
+int compare(const void*, const void*);
+double now();
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  int i, opt, warmup = 2, runs = 10, cpu = -1;
+  char* format = "text";
+  char* trace;
+  double* ms;
+  double mean = 0, var = 0, sd, ci, median, ratio, start;
+
+  while ((opt = getopt(argc, argv, "w:n:c:f:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'w':
+	  warmup = atoi(optarg);
+	  break;
+	case 'n':
+	  runs = atoi(optarg);
+	  break;
+	case 'c':
+	  cpu = atoi(optarg);
+	  break;
+	case 'f':
+	  format = optarg;
+	  break;
+	default:
+	  runs = 0;
+	}
+    }
+  if (argc - optind != 1 || runs < 1 || warmup < 0
+      || (strcmp(format, "text") != 0 && strcmp(format, "csv") != 0
+	  && strcmp(format, "json") != 0))
+    {
+      printf("Usage: %s [-w warmup] [-n runs] [-c cpu] [-f text|csv|json] trace_file\n",
+	     argv[0]);
+      exit(0);
+    }
+  trace = argv[optind];
+
+  if (cpu >= 0)
+    pin(cpu);
+
+  load(trace);
+
+  for (i = 0; i < warmup; i++)
+    replay();
+
+  ms = malloc(runs * sizeof(double));
+  if (ms == NULL)
+    error("out of memory for", "run times");
+  for (i = 0; i < runs; i++)
+    {
+      start = now();
+      replay();
+      ms[i] = (now() - start) / 1e6;
+    }
+
+  ratio = competitionRatio();
+
+  for (i = 0; i < runs; i++)
+    mean += ms[i];
+  mean /= runs;
+  for (i = 0; i < runs; i++)
+    var += (ms[i] - mean) * (ms[i] - mean);
+  sd = runs > 1 ? sqrt(var / (runs - 1)) : 0;
+  ci = runs > 1 ? (runs - 1 <= 30 ? kStudentT[runs - 2] : 1.960) * sd / sqrt(runs) : 0;
+
+  qsort(ms, runs, sizeof(double), compare);
+  median = runs % 2 ? ms[runs / 2] : (ms[runs / 2 - 1] + ms[runs / 2]) / 2;
+
+  // run_testcase.sh scores seconds, so does the score here
+  if (strcmp(format, "csv") == 0)
+    {
+      printf("%s,%s,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.6f,%.6f\n", ENGINE, trace, runs,
+	     mean, sd, ci, median, ms[0], ratio, ms[0] / 1e3 * (1 + ratio));
+    }
+  else if (strcmp(format, "json") == 0)
+    {
+      printf("{\"engine\": \"%s\", \"trace\": \"%s\", \"runs\": %d, \"mean_ms\": %.4f, "
+	     "\"stddev_ms\": %.4f, \"ci95_ms\": %.4f, \"median_ms\": %.4f, \"min_ms\": %.4f, "
+	     "\"ratio\": %.6f, \"score\": %.6f}\n", ENGINE, trace, runs, mean, sd, ci,
+	     median, ms[0], ratio, ms[0] / 1e3 * (1 + ratio));
+    }
+  else
+    {
+      printf("%s on %s, %d runs after %d warm-up:\n", ENGINE, trace, runs, warmup);
+      printf("  mean %.3f ms +- %.3f (95%%), stddev %.3f, median %.3f, min %.3f\n",
+	     mean, ci, sd, median, ms[0]);
+      printf("  competition ratio %f, score %f\n", ratio, ms[0] / 1e3 * (1 + ratio));
+    }
+
+  free(ms);
+  return 0;
+}
+
+void
+load(char* file)
+{
+  FILE* f = fopen(file, "r");
+  long long n_req;
+  long cap;
+  int id, size, maxId = 0;
+  char command[16];
+
+  if (f == NULL)
+    error("unable to open input test file", file);
+  if (fscanf(f, "%lld\n", &n_req) != 1 || n_req < 0)
+    error("Couldn't read number of requests at head of file", file);
+
+  cap = n_req > 0 ? n_req : 1024;
+  gOps = malloc(cap * sizeof(op_t));
+  if (gOps == NULL)
+    error("out of memory for", file);
+
+  while (fscanf(f, "%10s", command) == 1)
+    {
+      if (strcmp(command, "REQUEST") == 0)
+	{
+	  if (fscanf(f, "%d %d", &id, &size) != 2 || size <= 0)
+	    error("Not enough arguments to REQUEST", file);
+	}
+      else if (strcmp(command, "FREE") == 0)
+	{
+	  if (fscanf(f, "%d", &id) != 1)
+	    error("Not enough arguments to FREE", file);
+	  size = 0;
+	}
+      else
+	error("unknown command type:", command);
+
+      if (id < 0)
+	error("negative request id in", file);
+      if (gNumOps == cap)
+	{
+	  cap *= 2;
+	  gOps = realloc(gOps, cap * sizeof(op_t));
+	  if (gOps == NULL)
+	    error("out of memory for", file);
+	}
+      gOps[gNumOps].id = id;
+      gOps[gNumOps].size = size;
+      gNumOps++;
+      if (id > maxId)
+	maxId = id;
+    }
+  fclose(f);
+
+  gPtrs = calloc(maxId + 1, sizeof(void*));
+  gSizes = calloc(maxId + 1, sizeof(int));
+  if (gPtrs == NULL || gSizes == NULL)
+    error("out of memory for", file);
+}
+
+// one pass over the trace; every run has to leave the engine empty
+void
+replay()
+{
+  long i;
+  op_t* op;
+
+  for (i = 0, op = gOps; i < gNumOps; i++, op++)
+    {
+      if (op->size != 0)
+	{
+	  gPtrs[op->id] = kma_malloc(op->size);
+	  gSizes[op->id] = op->size;
+	  if (gPtrs[op->id] == NULL)
+	    error("got NULL from kma_malloc", "");
+	}
+      else
+	{
+	  kma_free(gPtrs[op->id], gSizes[op->id]);
+	}
+    }
+
+  if (page_stats()->num_in_use != 0)
+    error("not all pages freed", "");
+}
+
+// the average ratio of wasted to used memory, as in kma.c
+double
+competitionRatio()
+{
+  long i, count = 0, live = 0;
+  long long liveBytes = 0, totalBytes;
+  double sum = 0;
+  op_t* op;
+
+  for (i = 0, op = gOps; i < gNumOps; i++, op++)
+    {
+      if (op->size != 0)
+	{
+	  gPtrs[op->id] = kma_malloc(op->size);
+	  gSizes[op->id] = op->size;
+	  liveBytes += op->size;
+	  live++;
+	}
+      else
+	{
+	  kma_free(gPtrs[op->id], gSizes[op->id]);
+	  liveBytes -= gSizes[op->id];
+	  live--;
+	}
+
+      if (live > 0)
+	{
+	  totalBytes = (long long) page_stats()->num_in_use * page_stats()->page_size;
+	  sum += (double) (totalBytes - liveBytes) / liveBytes;
+	  count++;
+	}
+    }
+
+  return count ? sum / count : 0;
+}
+
+void
+pin(int cpu)
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    perror("sched_setaffinity");
+}
+
+int
+compare(const void* a, const void* b)
+{
+  double x = *(const double*) a, y = *(const double*) b;
+
+  return (x > y) - (x < y);
+}
+
+double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
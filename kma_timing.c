@@ -116,7 +116,7 @@ void fail();
 
 int anyMismatches = 0;
 
-int currentAllocBytes = 0;
+long long currentAllocBytes = 0;
 
 char *name = NULL;
 
@@ -206,7 +206,7 @@ main(int argc, char* argv[])
 	}
 
       stat = page_stats();
-      int totalBytes = stat->num_in_use * stat->page_size;
+      long long totalBytes = (long long) stat->num_in_use * stat->page_size;
 
       
 #ifdef COMPETITION
@@ -214,14 +214,14 @@ main(int argc, char* argv[])
 	{
 	  // We can calculate the ratio of wasted to used memory here.
 
-	  int wastedBytes = totalBytes - currentAllocBytes;
+	  long long wastedBytes = totalBytes - currentAllocBytes;
 	  ratioSum += ((double) wastedBytes) / currentAllocBytes;
 	  ratioCount += 1;
 	}
 #endif
 
 #ifndef COMPETITION
-      fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
+      fprintf(allocTrace, "%d %lld %lld\n", index, currentAllocBytes, totalBytes);
 #endif
       
       index += 1;
@@ -316,16 +316,11 @@ allocate(mem_t* requests, int req_id, int req_size)
   
   alloc_accum += difference;
 
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
-    {
-      error("got NULL from kma_malloc for alloc'able request", "");
-    }
-  
+  // Requests larger than a page are served from page runs, so
+  // every request has to succeed
   if (new->ptr == NULL)
     {
-      return;
+      error("got NULL from kma_malloc for alloc'able request", "");
     }
 
   currentAllocBytes += req_size;
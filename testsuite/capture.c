@@ -0,0 +1,471 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Capture the malloc traffic of a program as kma traces
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  Preload library that records malloc, calloc, realloc, the aligned
+ *  allocators and free of an unmodified program in the REQUEST/FREE
+ *  format read by kma.c:
+ *
+ *    make capture
+ *    KMA_TRACE=/tmp/svc LD_PRELOAD=testsuite/capture.so program args
+ *
+ *  Every thread writes its own stream, <KMA_TRACE>.<pid>.<tid>.trace
+ *  (KMA_TRACE defaults to kma_capture), and numbers its requests from 0.
+ *  A free is written to the stream of the thread that made the
+ *  allocation, so each stream replays on its own. realloc is recorded
+ *  as a REQUEST of the new size followed by a FREE of the old buffer.
+ *  Buffers still live at exit are freed at the end of their stream.
+ *
+ *  The real allocations are done by glibc (__libc_malloc and friends).
+ *  Lines are formatted by hand into a per-stream buffer and written with
+ *  write(2), so capturing never allocates through the hooks itself. The
+ *  line count is patched into the padded first line when the stream is
+ *  closed.
+ ***************************************************************************/
+
+#define _GNU_SOURCE
+
+/************System include***********************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define BUFSIZE (64 * 1024)
+
+// width of the line count on the first line of a stream
+#define HEADERSIZE 12
+
+// live buffers are kept in a chained hash table split into shards, each
+// with its own lock
+#define NUMSHARDS 256
+#define NUMBUCKETS (1 << 20)
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+typedef struct stream
+{
+  pthread_mutex_t lock;
+  int fd;
+  int next_id;
+  long lines;
+  int len;
+  struct stream* next;
+  char buf[BUFSIZE];
+} stream_t;
+
+typedef struct entry
+{
+  void* ptr;
+  stream_t* stream;
+  int id;
+  struct entry* next;
+} entry_t;
+
+/************Global Variables*********************************************/
+
+static volatile int gReady = 0;
+
+static const char* gPrefix = "kma_capture";
+
+static pthread_mutex_t gStreamsLock = PTHREAD_MUTEX_INITIALIZER;
+static stream_t* gStreams = NULL;
+
+static pthread_mutex_t gShards[NUMSHARDS];
+static entry_t** gBuckets = NULL;
+
+static TLS stream_t* tStream = NULL;
+
+// set while the hooks run, so that allocations made by libc on our
+// behalf are passed through untraced
+static TLS int tBusy = 0;
+
+/************Function Prototypes******************************************/
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+extern void* __libc_memalign(size_t, size_t);
+extern void __libc_free(void*);
+
+static void init() __attribute__((constructor));
+static void fini() __attribute__((destructor));
+static void atforkChild();
+static stream_t* myStream();
+static void emit(stream_t*, const char*, int, size_t, int);
+static void flush(stream_t*);
+static char* itoa(char*, unsigned long);
+static unsigned long hash(void*);
+static void track(void*, size_t);
+static entry_t* detach(void*);
+static void attach(entry_t*);
+static void retire(entry_t*);
+
+/**************Implementation***********************************************/
+
+static void
+init()
+{
+  int i;
+  char* prefix = getenv("KMA_TRACE");
+
+  if (prefix != NULL && *prefix != '\0')
+    gPrefix = prefix;
+
+  for (i = 0; i < NUMSHARDS; i++)
+    pthread_mutex_init(&gShards[i], NULL);
+
+  gBuckets = __libc_calloc(NUMBUCKETS, sizeof(entry_t*));
+  if (gBuckets == NULL)
+    return;
+
+  pthread_atfork(NULL, NULL, atforkChild);
+  gReady = 1;
+}
+
+// close every stream: free what is still live, then patch the headers
+static void
+fini()
+{
+  int i;
+  entry_t* e;
+  stream_t* s;
+  char header[HEADERSIZE];
+  char digits[24];
+  char* p;
+
+  if (!gReady)
+    return;
+  gReady = 0;
+  tBusy = 1;
+
+  for (i = 0; i < NUMBUCKETS; i++)
+    {
+      for (e = gBuckets[i]; e != NULL; e = e->next)
+	{
+	  pthread_mutex_lock(&e->stream->lock);
+	  emit(e->stream, "FREE ", e->id, 0, 0);
+	  pthread_mutex_unlock(&e->stream->lock);
+	}
+    }
+
+  for (s = gStreams; s != NULL; s = s->next)
+    {
+      pthread_mutex_lock(&s->lock);
+      flush(s);
+      memset(header, ' ', HEADERSIZE);
+      header[HEADERSIZE - 1] = '\n';
+      p = itoa(digits, s->lines);
+      memcpy(header + HEADERSIZE - 1 - (digits + sizeof(digits) - p), p,
+	     digits + sizeof(digits) - p);
+      if (pwrite(s->fd, header, HEADERSIZE, 0) != HEADERSIZE)
+	errno = 0;
+      close(s->fd);
+      pthread_mutex_unlock(&s->lock);
+    }
+}
+
+// the child would write into its parent's streams, so it is not traced
+static void
+atforkChild()
+{
+  gReady = 0;
+}
+
+static stream_t*
+myStream()
+{
+  char name[4096];
+  char digits[24];
+  char* p;
+  size_t n;
+  stream_t* s = tStream;
+
+  if (s != NULL)
+    return s;
+
+  n = strlen(gPrefix);
+  if (n > sizeof(name) - 64)
+    return NULL;
+  memcpy(name, gPrefix, n);
+  name[n++] = '.';
+  p = itoa(digits, getpid());
+  memcpy(name + n, p, digits + sizeof(digits) - p);
+  n += digits + sizeof(digits) - p;
+  name[n++] = '.';
+  p = itoa(digits, syscall(SYS_gettid));
+  memcpy(name + n, p, digits + sizeof(digits) - p);
+  n += digits + sizeof(digits) - p;
+  strcpy(name + n, ".trace");
+
+  s = __libc_malloc(sizeof(stream_t));
+  if (s == NULL)
+    return NULL;
+  s->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (s->fd < 0)
+    {
+      __libc_free(s);
+      return NULL;
+    }
+  pthread_mutex_init(&s->lock, NULL);
+  s->next_id = 0;
+  s->lines = 0;
+  memset(s->buf, ' ', HEADERSIZE);
+  s->buf[HEADERSIZE - 1] = '\n';
+  s->len = HEADERSIZE;
+
+  pthread_mutex_lock(&gStreamsLock);
+  s->next = gStreams;
+  gStreams = s;
+  pthread_mutex_unlock(&gStreamsLock);
+
+  tStream = s;
+  return s;
+}
+
+// append "<cmd><id>[ <size>]\n"; the caller holds the stream lock
+static void
+emit(stream_t* s, const char* cmd, int id, size_t size, int withSize)
+{
+  char digits[24];
+  char* p;
+  int n;
+
+  if (s->len + 64 > BUFSIZE)
+    flush(s);
+
+  n = strlen(cmd);
+  memcpy(s->buf + s->len, cmd, n);
+  s->len += n;
+  p = itoa(digits, id);
+  memcpy(s->buf + s->len, p, digits + sizeof(digits) - p);
+  s->len += digits + sizeof(digits) - p;
+  if (withSize)
+    {
+      s->buf[s->len++] = ' ';
+      p = itoa(digits, size);
+      memcpy(s->buf + s->len, p, digits + sizeof(digits) - p);
+      s->len += digits + sizeof(digits) - p;
+    }
+  s->buf[s->len++] = '\n';
+  s->lines++;
+}
+
+static void
+flush(stream_t* s)
+{
+  int done = 0;
+
+  while (done < s->len)
+    {
+      ssize_t n = write(s->fd, s->buf + done, s->len - done);
+      if (n <= 0)
+	{
+	  if (n < 0 && errno == EINTR)
+	    continue;
+	  break;
+	}
+      done += n;
+    }
+  s->len = 0;
+}
+
+// formats v right-aligned into the 24 byte buffer, returns its start
+static char*
+itoa(char* digits, unsigned long v)
+{
+  char* p = digits + 24;
+
+  do
+    {
+      *--p = '0' + v % 10;
+      v /= 10;
+    }
+  while (v != 0);
+  return p;
+}
+
+static unsigned long
+hash(void* ptr)
+{
+  return ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15UL >> 44;
+}
+
+// record a new buffer as a REQUEST in the calling thread's stream
+static void
+track(void* ptr, size_t size)
+{
+  stream_t* s;
+  entry_t* e;
+
+  if (ptr == NULL || !gReady || tBusy)
+    return;
+  tBusy = 1;
+
+  s = myStream();
+  e = __libc_malloc(sizeof(entry_t));
+  if (s != NULL && e != NULL)
+    {
+      pthread_mutex_lock(&s->lock);
+      e->ptr = ptr;
+      e->stream = s;
+      e->id = s->next_id++;
+      emit(s, "REQUEST ", e->id, size > 0 ? size : 1, 1);
+      pthread_mutex_unlock(&s->lock);
+
+      attach(e);
+    }
+  else if (e != NULL)
+    __libc_free(e);
+
+  tBusy = 0;
+}
+
+// take a traced buffer out of the table, NULL if it is not known
+static entry_t*
+detach(void* ptr)
+{
+  unsigned long h;
+  pthread_mutex_t* shard;
+  entry_t** link;
+  entry_t* e = NULL;
+
+  if (ptr == NULL || !gReady || tBusy)
+    return NULL;
+
+  h = hash(ptr);
+  shard = &gShards[h % NUMSHARDS];
+  pthread_mutex_lock(shard);
+  for (link = &gBuckets[h]; *link != NULL; link = &(*link)->next)
+    {
+      if ((*link)->ptr == ptr)
+	{
+	  e = *link;
+	  *link = e->next;
+	  break;
+	}
+    }
+  pthread_mutex_unlock(shard);
+  return e;
+}
+
+// put a detached buffer back, e.g. when realloc failed
+static void
+attach(entry_t* e)
+{
+  unsigned long h = hash(e->ptr);
+  pthread_mutex_t* shard = &gShards[h % NUMSHARDS];
+
+  pthread_mutex_lock(shard);
+  e->next = gBuckets[h];
+  gBuckets[h] = e;
+  pthread_mutex_unlock(shard);
+}
+
+// record the FREE of a detached buffer in the stream that made it
+static void
+retire(entry_t* e)
+{
+  pthread_mutex_lock(&e->stream->lock);
+  emit(e->stream, "FREE ", e->id, 0, 0);
+  pthread_mutex_unlock(&e->stream->lock);
+  __libc_free(e);
+}
+
+void*
+malloc(size_t size)
+{
+  void* ptr = __libc_malloc(size);
+  track(ptr, size);
+  return ptr;
+}
+
+void*
+calloc(size_t n, size_t size)
+{
+  void* ptr = __libc_calloc(n, size);
+  track(ptr, n * size);
+  return ptr;
+}
+
+void*
+realloc(void* old, size_t size)
+{
+  void* ptr;
+  entry_t* e;
+
+  if (old == NULL)
+    return malloc(size);
+  if (size == 0)
+    {
+      free(old);
+      return NULL;
+    }
+
+  // the new buffer is requested before the old one is freed, even when
+  // glibc grows it in place
+  e = detach(old);
+  ptr = __libc_realloc(old, size);
+  if (ptr == NULL)
+    {
+      if (e != NULL)
+	attach(e);
+      return NULL;
+    }
+  track(ptr, size);
+  if (e != NULL)
+    retire(e);
+  return ptr;
+}
+
+void
+free(void* ptr)
+{
+  entry_t* e = detach(ptr);
+
+  if (e != NULL)
+    retire(e);
+  __libc_free(ptr);
+}
+
+void*
+memalign(size_t align, size_t size)
+{
+  void* ptr = __libc_memalign(align, size);
+  track(ptr, size);
+  return ptr;
+}
+
+void*
+aligned_alloc(size_t align, size_t size)
+{
+  return memalign(align, size);
+}
+
+int
+posix_memalign(void** out, size_t align, size_t size)
+{
+  void* ptr;
+
+  if (align < sizeof(void*) || (align & (align - 1)) != 0)
+    return EINVAL;
+  ptr = memalign(align, size);
+  if (ptr == NULL)
+    return ENOMEM;
+  *out = ptr;
+  return 0;
+}
@@ -0,0 +1,132 @@
+#!/bin/bash
+#
+# Times every engine on every trace with the kma_<engine>_runner binaries
+# ("make runners"): warm-up runs, then timed in-process replays, so
+# process start and trace parsing are not measured as they are by the
+# "time -p" loop of run_testcase.sh. Pairs run in parallel, one per CPU,
+# each pinned to its own CPU. Results go to <prefix>.csv and
+# <prefix>.json; with -b the means are compared to a baseline CSV and
+# the script exits 1 on a regression:
+#
+#   a pair is slower when its mean grew by more than the threshold and
+#   the 95% confidence intervals do not overlap, and it wastes more when
+#   its competition ratio grew
+#
+# usage: run_bench.sh [-n runs] [-w warmup] [-j jobs] [-e "engines"]
+#                     [-o prefix] [-b baseline.csv] [-t percent] [trace ...]
+# Run it from the top directory; the traces default to testsuite/*.trace.
+
+RUNS=10
+WARMUP=2
+JOBS=`nproc`
+ENGINES="rm p2fl mck2 bud lzbud hybrid"
+PREFIX=kma_runs
+BASELINE=
+THRESHOLD=5
+
+while getopts "n:w:j:e:o:b:t:" opt; do
+	case $opt in
+	n) RUNS=$OPTARG;;
+	w) WARMUP=$OPTARG;;
+	j) JOBS=$OPTARG;;
+	e) ENGINES=$OPTARG;;
+	o) PREFIX=$OPTARG;;
+	b) BASELINE=$OPTARG;;
+	t) THRESHOLD=$OPTARG;;
+	*) echo "usage: $0 [-n runs] [-w warmup] [-j jobs] [-e \"engines\"] [-o prefix] [-b baseline.csv] [-t percent] [trace ...]";
+	   exit 1;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [[ $# -gt 0 ]]; then
+	TRACES="$@"
+else
+	TRACES=`ls testsuite/*.trace | sort -V`
+fi
+
+for e in ${ENGINES}; do
+	if [[ ! -x ./kma_${e}_runner ]]; then
+		echo "error: ./kma_${e}_runner is missing, run \"make runners\"";
+		exit 1;
+	fi;
+done
+
+# the CPUs we may run on, e.g. "0-3,8-11" in /proc/self/status
+CPUS=()
+for range in `grep Cpus_allowed_list /proc/self/status | awk '{ print $2 }' | tr ',' ' '`; do
+	CPUS+=(`seq ${range%-*} ${range#*-}`);
+done
+if [[ ${JOBS} -gt ${#CPUS[@]} ]]; then
+	JOBS=${#CPUS[@]};
+fi
+
+TMP=`mktemp -d /tmp/kma.runs.XXXXXX`;
+trap "rm -Rf ${TMP}" EXIT
+
+# one slot per CPU; a pair takes the first slot whose job has finished
+SLOTS=()
+N=0
+for e in ${ENGINES}; do
+	for t in ${TRACES}; do
+		while true; do
+			FREE=-1
+			for ((s = 0; s < JOBS; s++)); do
+				if [[ -z "${SLOTS[$s]}" ]] || ! kill -0 ${SLOTS[$s]} 2> /dev/null; then
+					FREE=$s;
+					break;
+				fi;
+			done
+			[[ ${FREE} -ge 0 ]] && break;
+			wait -n;
+		done
+		./kma_${e}_runner -w ${WARMUP} -n ${RUNS} -c ${CPUS[$FREE]} -f csv $t \
+			> ${TMP}/$N.csv 2> ${TMP}/$N.err &
+		SLOTS[$FREE]=$!
+		N=$((N + 1))
+	done
+done
+wait
+
+FAILED=0
+echo "engine,trace,runs,mean_ms,stddev_ms,ci95_ms,median_ms,min_ms,ratio,score" > ${PREFIX}.csv
+for ((i = 0; i < N; i++)); do
+	if [[ -s ${TMP}/$i.err || ! -s ${TMP}/$i.csv ]]; then
+		cat ${TMP}/$i.err;
+		FAILED=1;
+	fi;
+	cat ${TMP}/$i.csv >> ${PREFIX}.csv;
+done
+
+awk -F, 'NR == 1 { split($0, name, ","); print "["; next }
+	{ printf "%s  {", (NR > 2 ? ",\n" : "");
+	  for (i = 1; i <= NF; i++)
+		printf "%s\"%s\": %s", (i > 1 ? ", " : ""), name[i], (i <= 2 ? "\"" $i "\"" : $i);
+	  printf "}" }
+	END { print "\n]" }' ${PREFIX}.csv > ${PREFIX}.json
+
+awk -F, 'NR > 1 { printf "%-6s %-24s %10.3f ms +- %8.3f  median %10.3f  ratio %f\n", $1, $2, $4, $6, $7, $9 }' ${PREFIX}.csv
+echo "Wrote ${PREFIX}.csv and ${PREFIX}.json";
+
+if [[ -n "${BASELINE}" ]]; then
+	echo;
+	echo "Compared to ${BASELINE} (threshold ${THRESHOLD}%):";
+	awk -F, -v threshold=${THRESHOLD} '
+		FNR == 1 { next }
+		NR == FNR { mean[$1 "," $2] = $4; ci[$1 "," $2] = $6; ratio[$1 "," $2] = $9; next }
+		{
+			key = $1 "," $2;
+			if (!(key in mean)) { printf "%-6s %-24s new\n", $1, $2; next }
+			delta = 100 * ($4 - mean[key]) / mean[key];
+			status = "";
+			if (delta > threshold && $4 - $6 > mean[key] + ci[key]) { status = "SLOWER"; bad = 1 }
+			else if (delta < -threshold && $4 + $6 < mean[key] - ci[key]) status = "faster";
+			if ($9 > ratio[key] + 1e-6) { status = status " WASTES MORE"; bad = 1 }
+			else if ($9 < ratio[key] - 1e-6) status = status " wastes less";
+			printf "%-6s %-24s %10.3f -> %10.3f ms %+7.1f%%  ratio %f -> %f %s\n",
+				$1, $2, mean[key], $4, delta, ratio[key], $9, status;
+		}
+		END { exit bad }' ${BASELINE} ${PREFIX}.csv || FAILED=1;
+fi
+
+exit ${FAILED}
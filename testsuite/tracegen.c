@@ -0,0 +1,402 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Native trace generator for the kernel memory allocator
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  Streams a trace in the format read by kma.c:
+ *
+ *    <number of lines>
+ *    REQUEST <id> <size>
+ *    FREE <id>
+ *
+ *  Every allocation is given a time of death (counted in allocations)
+ *  when it is made and kept in a heap, so the generator only holds the
+ *  live objects and writes the trace in a single pass.
+ *
+ *  usage: tracegen [options] allocation_count out_file
+ *
+ *    -s log:MIN:MAX          request sizes, log distributed (default 1:8192)
+ *       linear:MIN:MAX       uniformly distributed
+ *       fixed:S1,S2,...      one of the listed sizes
+ *       bimodal:S:L:PCT      S with probability PCT%, L otherwise
+ *    -l uniform              free at a uniformly chosen later point (default)
+ *       early                90% of the frees within the next 10% of the trace
+ *       exp:MEAN             exponential lifetimes, MEAN allocations on average
+ *       sized:MEAN           exponential, mean scaled by log2(size), so that
+ *                            the largest size lives MEAN allocations on average
+ *       fifo:N               producer/consumer, freed exactly N allocations later
+ *    -p N                    N phases; each phase narrows the sizes to its own
+ *                            window and frees its objects by the phase end
+ *    -b LEN:EVERY            every EVERY allocations a burst of LEN equal
+ *                            requests, freed together LEN allocations later
+ *    -r SEED                 random seed (default 1)
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define MAXFIXED 64
+
+// initial room of the heap of pending frees, in objects
+#define HEAPSTART 1024
+
+typedef enum
+{
+  S_LOG,
+  S_LINEAR,
+  S_FIXED,
+  S_BIMODAL
+} sizemodel_t;
+
+typedef enum
+{
+  L_UNIFORM,
+  L_EARLY,
+  L_EXP,
+  L_SIZED,
+  L_FIFO
+} lifemodel_t;
+
+typedef struct
+{
+  long death;
+  int id;
+  int size;
+} obj_t;
+
+/************Global Variables*********************************************/
+
+static sizemodel_t gSizeModel = S_LOG;
+static double gMin = 1, gMax = 8192;
+static int gFixed[MAXFIXED];
+static int gNumFixed = 0;
+static double gPct = 50;
+
+static lifemodel_t gLifeModel = L_UNIFORM;
+static double gMean = 0;
+
+static long gPhases = 1;
+static long gBurstLen = 0, gBurstEvery = 0;
+
+// the size window of the current phase
+static double gLo, gHi;
+
+// pending frees, a binary min-heap ordered by (death, id), grown by
+// doubling as the live set grows
+static obj_t* gHeap;
+static long gHeapLen = 0;
+static long gHeapCap = 0;
+
+/************Function Prototypes******************************************/
+static void usage(char*);
+static double rnd();
+static void startPhase(long);
+static int drawSize();
+static long drawDeath(long, long, int);
+static int before(obj_t*, obj_t*);
+static void push(obj_t);
+static obj_t pop();
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  long count, i, phaseEnd = 0, burstLeft = 0, burstDeath = 0;
+  long long live = 0, peak = 0;
+  int burstSize = 0, c;
+  char* arg;
+  FILE* out;
+
+  while ((c = getopt(argc, argv, "s:l:p:b:r:")) != -1)
+    {
+      switch (c)
+	{
+	case 's':
+	  if (sscanf(optarg, "log:%lf:%lf", &gMin, &gMax) == 2)
+	    gSizeModel = S_LOG;
+	  else if (sscanf(optarg, "linear:%lf:%lf", &gMin, &gMax) == 2)
+	    gSizeModel = S_LINEAR;
+	  else if (sscanf(optarg, "bimodal:%lf:%lf:%lf", &gMin, &gMax, &gPct) == 3)
+	    gSizeModel = S_BIMODAL;
+	  else if (strncmp(optarg, "fixed:", 6) == 0)
+	    {
+	      gSizeModel = S_FIXED;
+	      for (arg = strtok(optarg + 6, ","); arg != NULL && gNumFixed < MAXFIXED;
+		   arg = strtok(NULL, ","))
+		{
+		  gFixed[gNumFixed++] = atoi(arg);
+		}
+	    }
+	  else
+	    usage(argv[0]);
+	  break;
+	case 'l':
+	  if (strcmp(optarg, "uniform") == 0)
+	    gLifeModel = L_UNIFORM;
+	  else if (strcmp(optarg, "early") == 0)
+	    gLifeModel = L_EARLY;
+	  else if (sscanf(optarg, "exp:%lf", &gMean) == 1)
+	    gLifeModel = L_EXP;
+	  else if (sscanf(optarg, "sized:%lf", &gMean) == 1)
+	    gLifeModel = L_SIZED;
+	  else if (sscanf(optarg, "fifo:%lf", &gMean) == 1)
+	    gLifeModel = L_FIFO;
+	  else
+	    usage(argv[0]);
+	  break;
+	case 'p':
+	  gPhases = atol(optarg);
+	  break;
+	case 'b':
+	  if (sscanf(optarg, "%ld:%ld", &gBurstLen, &gBurstEvery) != 2)
+	    usage(argv[0]);
+	  break;
+	case 'r':
+	  srand48(atol(optarg));
+	  break;
+	default:
+	  usage(argv[0]);
+	}
+    }
+
+  if (argc - optind != 2)
+    usage(argv[0]);
+
+  count = atol(argv[optind]);
+  if (count <= 0 || count > 0x7fffffff / 2 || gPhases < 1 || gMin < 1 || gMax < gMin
+      || (gSizeModel == S_FIXED && gNumFixed == 0) || (gLifeModel != L_UNIFORM
+      && gLifeModel != L_EARLY && gMean < 1) || (gBurstLen > 0 && gBurstEvery <= gBurstLen))
+    usage(argv[0]);
+
+  if ((out = fopen(argv[optind + 1], "w")) == NULL)
+    {
+      perror(argv[optind + 1]);
+      exit(1);
+    }
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+  fprintf(out, "%ld\n", 2 * count);
+
+  for (i = 0; i < count; i++)
+    {
+      obj_t obj;
+
+      if (i == phaseEnd)
+	{
+	  startPhase(i);
+	  phaseEnd = i + (count + gPhases - 1) / gPhases;
+	  if (phaseEnd > count)
+	    phaseEnd = count;
+	}
+
+      while (gHeapLen > 0 && gHeap[0].death <= i)
+	{
+	  obj = pop();
+	  fprintf(out, "FREE %d\n", obj.id);
+	  live -= obj.size;
+	}
+
+      obj.id = i;
+      if (burstLeft == 0 && gBurstLen > 0 && i % gBurstEvery == 0)
+	{
+	  burstLeft = gBurstLen;
+	  burstSize = drawSize();
+	  burstDeath = i + 2 * gBurstLen;
+	}
+      if (burstLeft > 0)
+	{
+	  burstLeft--;
+	  obj.size = burstSize;
+	  obj.death = burstDeath;
+	}
+      else
+	{
+	  obj.size = drawSize();
+	  obj.death = drawDeath(i, count, obj.size);
+	}
+      if (gPhases > 1 && obj.death > phaseEnd)
+	obj.death = phaseEnd;
+
+      fprintf(out, "REQUEST %d %d\n", obj.id, obj.size);
+      push(obj);
+      live += obj.size;
+      if (live > peak)
+	peak = live;
+    }
+
+  while (gHeapLen > 0)
+    {
+      fprintf(out, "FREE %d\n", pop().id);
+    }
+
+  if (fclose(out) != 0)
+    {
+      perror(argv[optind + 1]);
+      exit(1);
+    }
+
+  printf("%ld allocations, %ld deallocations\n", count, count);
+  printf("Maximum bytes allocated: %lld\n", peak);
+
+  free(gHeap);
+  return 0;
+}
+
+static void
+usage(char* name)
+{
+  fprintf(stderr, "Usage: %s [-s log:MIN:MAX|linear:MIN:MAX|fixed:S1,S2,...|bimodal:S:L:PCT]\n"
+	  "\t[-l uniform|early|exp:MEAN|sized:MEAN|fifo:N] [-p PHASES] [-b LEN:EVERY]\n"
+	  "\t[-r SEED] allocation_count out_file\n", name);
+  exit(1);
+}
+
+static double
+rnd()
+{
+  return drand48();
+}
+
+// every phase draws from its own quarter of the size range (log scaled
+// for the log model), or a single size for fixed mixes
+static void
+startPhase(long i)
+{
+  double w;
+
+  gLo = gMin;
+  gHi = gMax;
+  if (gPhases == 1)
+    return;
+
+  switch (gSizeModel)
+    {
+    case S_LOG:
+      w = (log2(gMax) - log2(gMin)) / 4;
+      gLo = pow(2, log2(gMin) + rnd() * 3 * w);
+      gHi = gLo * pow(2, w);
+      break;
+    case S_LINEAR:
+      w = (gMax - gMin) / 4;
+      gLo = gMin + rnd() * 3 * w;
+      gHi = gLo + w;
+      break;
+    case S_FIXED:
+      gLo = gHi = gFixed[(int)(rnd() * gNumFixed)];
+      break;
+    case S_BIMODAL:
+      // flip which mode dominates
+      if (i > 0)
+	gPct = 100 - gPct;
+      break;
+    }
+}
+
+static int
+drawSize()
+{
+  switch (gSizeModel)
+    {
+    case S_LOG:
+      return (int)pow(2.0, log2(gLo) + rnd() * (log2(gHi) - log2(gLo)));
+    case S_LINEAR:
+      return (int)(gLo + rnd() * (gHi - gLo));
+    case S_FIXED:
+      if (gPhases > 1)
+	return (int)gLo;
+      return gFixed[(int)(rnd() * gNumFixed)];
+    case S_BIMODAL:
+      return rnd() * 100 < gPct ? (int)gMin : (int)gMax;
+    }
+  return (int)gMin;
+}
+
+// the allocation index before which object i is freed; count or more
+// means it lives until the end of the trace
+static long
+drawDeath(long i, long count, int size)
+{
+  double mean;
+
+  switch (gLifeModel)
+    {
+    case L_UNIFORM:
+      return i + 1 + (long)(rnd() * (count - i));
+    case L_EARLY:
+      if (rnd() < 0.9)
+	return i + 1 + (long)(rnd() * 0.1 * (count - i));
+      return i + 1 + (long)(rnd() * (count - i));
+    case L_EXP:
+      return i + 1 + (long)(-gMean * log(1 - rnd()));
+    case L_SIZED:
+      mean = gMean * (log2(size) + 1) / (log2(gMax) + 1);
+      return i + 1 + (long)(-mean * log(1 - rnd()));
+    case L_FIFO:
+      return i + (long)gMean;
+    }
+  return count;
+}
+
+static int
+before(obj_t* a, obj_t* b)
+{
+  return a->death < b->death || (a->death == b->death && a->id < b->id);
+}
+
+static void
+push(obj_t obj)
+{
+  long n = gHeapLen++;
+
+  if (gHeapLen > gHeapCap)
+    {
+      gHeapCap = gHeapCap == 0 ? HEAPSTART : 2 * gHeapCap;
+      gHeap = realloc(gHeap, gHeapCap * sizeof(obj_t));
+      if (gHeap == NULL)
+	{
+	  perror("realloc");
+	  exit(1);
+	}
+    }
+
+  while (n > 0 && before(&obj, &gHeap[(n - 1) / 2]))
+    {
+      gHeap[n] = gHeap[(n - 1) / 2];
+      n = (n - 1) / 2;
+    }
+  gHeap[n] = obj;
+}
+
+static obj_t
+pop()
+{
+  obj_t top = gHeap[0], last = gHeap[--gHeapLen];
+  long n = 0, child;
+
+  while ((child = 2 * n + 1) < gHeapLen)
+    {
+      if (child + 1 < gHeapLen && before(&gHeap[child + 1], &gHeap[child]))
+	child++;
+      if (!before(&gHeap[child], &last))
+	break;
+      gHeap[n] = gHeap[child];
+      n = child;
+    }
+  gHeap[n] = last;
+  return top;
+}
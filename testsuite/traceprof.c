@@ -0,0 +1,673 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Size and lifetime profiler for kma traces
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  Reads a trace in the format of kma.c and prints
+ *
+ *    - the request size histogram (powers of two)
+ *    - per size bucket, the lifetime distribution in trace steps
+ *    - peak live bytes and objects, and the live size mix at the peak
+ *    - the theoretical minimum number of pages, ceil(live bytes /
+ *      page size), at the peak and on average over the steps with
+ *      live requests
+ *
+ *  With -d the minimum is written for every step as "index live bytes
+ *  minimum bytes", the same columns as kma_output.dat, so the two can be
+ *  plotted against each other. The trace is streamed; only the live
+ *  requests are kept in memory.
+ *
+ *  With -c N it instead picks at most N size classes for the segregated
+ *  engines (kma_p2fl, kma_mck2) that minimize the expected waste of a
+ *  request: the rounding up to its class plus the class's share of the
+ *  page tail that no buffer fits into. Classes are multiples of 8 of at
+ *  least 16 bytes and the largest is a whole page, so every request that
+ *  is not served by a page run has a class; kma_p2fl serves that last
+ *  class with whole pages, so there are at least two. The table is written as a
+ *  header (-o, kma_classes.h by default) that the engines include. -C
+ *  takes a table instead, e.g. to write back the powers of two. -a adds a
+ *  per-buffer header to every request first, 8 bytes for kma_p2fl. With
+ *  -S the input is a size profile of "size count" lines, not a trace.
+ *
+ *  usage: traceprof [-p pagesize] [-d out.dat] trace_file
+ *         traceprof -c N|-C S1,S2,... [-a bytes] [-o header] [-S] trace_file
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// power of two buckets: sizes up to 2^31, lifetimes up to 2^47 steps
+#define SIZEBUCKETS 32
+#define LIFEBUCKETS 48
+
+// size classes are multiples of GRAIN, at least MINCLASS bytes and at
+// most MAXCLASSES of them (KMA_NUMCLASSES, what the statistics report)
+#define GRAIN 8
+#define MINCLASS 16
+#define MAXCLASSES 24
+
+typedef struct
+{
+  int id;
+  int size;			// 0 marks a free slot
+  long long birth;
+} live_t;
+
+/************Global Variables*********************************************/
+
+static long long gSizes[SIZEBUCKETS];
+static long long gLives[SIZEBUCKETS][LIFEBUCKETS];
+static long long gLiveBytesBy[SIZEBUCKETS];
+static long long gLiveObjsBy[SIZEBUCKETS];
+static long long gPeakBytesBy[SIZEBUCKETS];
+static long long gPeakObjsBy[SIZEBUCKETS];
+
+// the live requests, open-addressed by request id
+static live_t* gLive = NULL;
+static long gSlots = 0;
+static long gCount = 0;
+
+// requests by size in GRAIN steps, index (size + GRAIN - 1) / GRAIN, and
+// the sum of their sizes; sizes past the last grain are page runs
+static long long* gGrainCount = NULL;
+static long long* gGrainBytes = NULL;
+static long gGrains = 0;
+
+/************Function Prototypes******************************************/
+static void usage(char*);
+static int bucket(unsigned long long);
+static live_t* findSlot(int);
+static void grow();
+static void removeSlot(live_t*);
+static void died(live_t*, long long);
+static void printLifetimes();
+static void countSize(long, long long, long, long);
+static void readProfile(FILE*, char*, long, long);
+static void chooseClasses(int, int*, long, long, char*, char*);
+static double tail(long, long);
+static double waste(int*, int, long);
+static int optimize(int, long, int*);
+static void writeClasses(char*, int*, int, long, long, char*);
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  long long n_req, step = 0, live = 0, objs = 0, peak = 0, peakObjs = 0;
+  long long peakStep = 0, minPagesSum = 0, liveSteps = 0, requests = 0;
+  long pageSize = 8192, overhead = 0;
+  int c, id, size, profile = 0, numClasses = 0, classes[MAXCLASSES];
+  long i;
+  char command[16], *header = "kma_classes.h", *arg;
+  FILE *in, *dat = NULL;
+  live_t* slot;
+
+  while ((c = getopt(argc, argv, "p:d:c:C:a:o:S")) != -1)
+    {
+      switch (c)
+	{
+	case 'p':
+	  pageSize = atol(optarg);
+	  break;
+	case 'c':
+	  numClasses = atoi(optarg);
+	  if (numClasses < 2 || numClasses > MAXCLASSES)
+	    usage(argv[0]);
+	  break;
+	case 'C':
+	  numClasses = 0;
+	  for (arg = strtok(optarg, ","); arg != NULL; arg = strtok(NULL, ","))
+	    {
+	      if (numClasses == MAXCLASSES)
+		usage(argv[0]);
+	      classes[numClasses++] = atoi(arg);
+	    }
+	  if (numClasses < 2)
+	    usage(argv[0]);
+	  numClasses = -numClasses;
+	  break;
+	case 'a':
+	  overhead = atol(optarg);
+	  break;
+	case 'o':
+	  header = optarg;
+	  break;
+	case 'S':
+	  profile = 1;
+	  break;
+	case 'd':
+	  if ((dat = fopen(optarg, "w")) == NULL)
+	    {
+	      perror(optarg);
+	      exit(1);
+	    }
+	  break;
+	default:
+	  usage(argv[0]);
+	}
+    }
+  if (argc - optind != 1 || pageSize <= 0 || pageSize % GRAIN != 0 || overhead < 0
+      || (profile && numClasses == 0))
+    usage(argv[0]);
+
+  if ((in = fopen(argv[optind], "r")) == NULL)
+    {
+      perror(argv[optind]);
+      exit(1);
+    }
+
+  gGrains = pageSize / GRAIN;
+  gGrainCount = calloc(gGrains + 1, sizeof(long long));
+  gGrainBytes = calloc(gGrains + 1, sizeof(long long));
+  if (gGrainCount == NULL || gGrainBytes == NULL)
+    {
+      perror("calloc");
+      exit(1);
+    }
+
+  if (profile)
+    {
+      readProfile(in, argv[optind], overhead, pageSize);
+      chooseClasses(numClasses, classes, pageSize, overhead, header, argv[optind]);
+      return 0;
+    }
+
+  if (fscanf(in, "%lld\n", &n_req) != 1)
+    {
+      fprintf(stderr, "%s: no request count at head of file\n", argv[optind]);
+      exit(1);
+    }
+
+  grow();
+  if (dat != NULL)
+    fprintf(dat, "0 0 0\n");
+
+  while (fscanf(in, "%10s", command) == 1)
+    {
+      step++;
+      if (strcmp(command, "REQUEST") == 0)
+	{
+	  if (fscanf(in, "%d %d", &id, &size) != 2 || size <= 0)
+	    {
+	      fprintf(stderr, "step %lld: bad REQUEST\n", step);
+	      exit(1);
+	    }
+	  if (2 * (gCount + 1) > gSlots)
+	    grow();
+	  slot = findSlot(id);
+	  if (slot->size != 0)
+	    {
+	      fprintf(stderr, "step %lld: request %d is already live\n", step, id);
+	      exit(1);
+	    }
+	  slot->id = id;
+	  slot->size = size;
+	  slot->birth = step;
+	  gCount++;
+
+	  requests++;
+	  countSize(size, 1, overhead, pageSize);
+	  gSizes[bucket(size)]++;
+	  gLiveBytesBy[bucket(size)] += size;
+	  gLiveObjsBy[bucket(size)]++;
+	  live += size;
+	  objs++;
+	}
+      else if (strcmp(command, "FREE") == 0)
+	{
+	  if (fscanf(in, "%d", &id) != 1)
+	    {
+	      fprintf(stderr, "step %lld: bad FREE\n", step);
+	      exit(1);
+	    }
+	  slot = findSlot(id);
+	  if (slot->size == 0)
+	    {
+	      fprintf(stderr, "step %lld: request %d is not live\n", step, id);
+	      exit(1);
+	    }
+	  live -= slot->size;
+	  objs--;
+	  died(slot, step);
+	  removeSlot(slot);
+	  gCount--;
+	}
+      else
+	{
+	  fprintf(stderr, "step %lld: unknown command %s\n", step, command);
+	  exit(1);
+	}
+
+      if (live > peak)
+	{
+	  peak = live;
+	  peakObjs = objs;
+	  peakStep = step;
+	  memcpy(gPeakBytesBy, gLiveBytesBy, sizeof(gLiveBytesBy));
+	  memcpy(gPeakObjsBy, gLiveObjsBy, sizeof(gLiveObjsBy));
+	}
+      if (objs > 0)
+	{
+	  minPagesSum += (live + pageSize - 1) / pageSize;
+	  liveSteps++;
+	}
+      if (dat != NULL)
+	fprintf(dat, "%lld %lld %lld\n", step, live,
+		(live + pageSize - 1) / pageSize * pageSize);
+    }
+
+  // whatever was never freed lives until the end of the trace
+  for (i = 0; i < gSlots; i++)
+    if (gLive[i].size != 0)
+      died(&gLive[i], step + 1);
+
+  if (dat != NULL)
+    fclose(dat);
+
+  if (numClasses != 0)
+    {
+      chooseClasses(numClasses, classes, pageSize, overhead, header, argv[optind]);
+      return 0;
+    }
+
+  printf("%lld steps, %lld requests, %ld never freed\n", step, requests, gCount);
+  if (step != n_req)
+    printf("warning: the header announces %lld steps\n", n_req);
+
+  printf("\nRequest sizes:\n");
+  printf("  %12s %12s %7s\n", "size <=", "requests", "%");
+  for (i = 0; i < SIZEBUCKETS; i++)
+    if (gSizes[i] != 0)
+      printf("  %12lld %12lld %6.1f%%\n", 1LL << i, gSizes[i],
+	     100.0 * gSizes[i] / requests);
+
+  printLifetimes();
+
+  printf("\nPeak live: %lld bytes in %lld objects at step %lld\n", peak,
+	 peakObjs, peakStep);
+  printf("  %12s %12s %14s %7s\n", "size <=", "objects", "bytes", "%");
+  for (i = 0; i < SIZEBUCKETS; i++)
+    if (gPeakObjsBy[i] != 0)
+      printf("  %12lld %12lld %14lld %6.1f%%\n", 1LL << i, gPeakObjsBy[i],
+	     gPeakBytesBy[i], 100.0 * gPeakBytesBy[i] / peak);
+
+  printf("\nMinimum pages of %ld bytes: %lld at the peak, %.1f on average\n",
+	 pageSize, (peak + pageSize - 1) / pageSize,
+	 liveSteps ? (double) minPagesSum / liveSteps : 0.0);
+
+  return 0;
+}
+
+static void
+usage(char* name)
+{
+  fprintf(stderr, "Usage: %s [-p pagesize] [-d out.dat] trace_file\n"
+	  "       %s -c N|-C S1,S2,... [-p pagesize] [-a bytes] [-o header] [-S] trace_file\n",
+	  name, name);
+  exit(1);
+}
+
+// smallest i with v <= 2^i
+static int
+bucket(unsigned long long v)
+{
+  int i = 0;
+
+  while (i < 63 && (1ULL << i) < v)
+    i++;
+  return i;
+}
+
+static live_t*
+findSlot(int id)
+{
+  long i = (long) (((uint64_t) id * 0x9e3779b97f4a7c15ULL) >> 20) & (gSlots - 1);
+
+  while (gLive[i].size != 0 && gLive[i].id != id)
+    i = (i + 1) & (gSlots - 1);
+  return &gLive[i];
+}
+
+static void
+grow()
+{
+  live_t* old = gLive;
+  long i, oldSlots = gSlots;
+
+  gSlots = oldSlots ? 2 * oldSlots : 1024;
+  gLive = calloc(gSlots, sizeof(live_t));
+  if (gLive == NULL)
+    {
+      perror("calloc");
+      exit(1);
+    }
+  for (i = 0; i < oldSlots; i++)
+    if (old[i].size != 0)
+      *findSlot(old[i].id) = old[i];
+  free(old);
+}
+
+// backward shift deletion, so that probe runs never have holes
+static void
+removeSlot(live_t* slot)
+{
+  long hole = slot - gLive, i = hole, home;
+
+  gLive[hole].size = 0;
+  for (;;)
+    {
+      i = (i + 1) & (gSlots - 1);
+      if (gLive[i].size == 0)
+	return;
+      home = (long) (((uint64_t) gLive[i].id * 0x9e3779b97f4a7c15ULL) >> 20) & (gSlots - 1);
+      if ((i > hole && (home <= hole || home > i))
+	  || (i < hole && home <= hole && home > i))
+	{
+	  gLive[hole] = gLive[i];
+	  gLive[i].size = 0;
+	  hole = i;
+	}
+    }
+}
+
+static void
+died(live_t* slot, long long step)
+{
+  int b = bucket(slot->size), l = bucket(step - slot->birth);
+
+  gLives[b][l < LIFEBUCKETS ? l : LIFEBUCKETS - 1]++;
+  gLiveBytesBy[b] -= slot->size;
+  gLiveObjsBy[b]--;
+}
+
+// quantiles are bucket bounds, so "p50 <= 64" means half of the
+// requests of that size died within 64 steps
+static void
+printLifetimes()
+{
+  int i, j, q;
+  static const double kQuantiles[] = { 0.5, 0.9, 0.99 };
+
+  printf("\nLifetimes in steps by request size (upper bounds):\n");
+  printf("  %12s %12s %12s %12s\n", "size <=", "p50", "p90", "p99");
+  for (i = 0; i < SIZEBUCKETS; i++)
+    {
+      long long total = 0, seen;
+
+      for (j = 0; j < LIFEBUCKETS; j++)
+	total += gLives[i][j];
+      if (total == 0)
+	continue;
+
+      printf("  %12lld", 1LL << i);
+      for (q = 0; q < 3; q++)
+	{
+	  seen = 0;
+	  for (j = 0; j < LIFEBUCKETS; j++)
+	    {
+	      seen += gLives[i][j];
+	      if (seen >= kQuantiles[q] * total)
+		break;
+	    }
+	  printf(" %12lld", 1LL << j);
+	}
+      printf("\n");
+    }
+}
+
+// count requests of size bytes that get a size class, that is all those
+// not served by a page run
+static void
+countSize(long size, long long count, long overhead, long pageSize)
+{
+  long g;
+
+  if (size + (long) sizeof(void*) > pageSize || size + overhead > pageSize)
+    return;
+  g = (size + overhead + GRAIN - 1) / GRAIN;
+  gGrainCount[g] += count;
+  gGrainBytes[g] += count * (size + overhead);
+}
+
+static void
+readProfile(FILE* in, char* name, long overhead, long pageSize)
+{
+  long size;
+  long long count;
+  int n;
+
+  while ((n = fscanf(in, "%ld %lld", &size, &count)) == 2)
+    {
+      if (size <= 0 || count < 0)
+	break;
+      countSize(size, count, overhead, pageSize);
+    }
+  if (n != EOF)
+    {
+      fprintf(stderr, "%s: expected \"size count\" lines\n", name);
+      exit(1);
+    }
+}
+
+// optimize or check the table, compare it to the powers of two and
+// write the header
+static void
+chooseClasses(int numClasses, int* classes, long pageSize, long overhead,
+	      char* header, char* source)
+{
+  int i, n, np = 0, pow2[MAXCLASSES];
+  long c;
+  long long requests = 0;
+
+  if (numClasses > 0)
+    n = optimize(numClasses, pageSize, classes);
+  else
+    {
+      n = -numClasses;
+      for (i = 0; i < n; i++)
+	{
+	  if (classes[i] < MINCLASS || classes[i] % GRAIN != 0
+	      || (i > 0 && classes[i] <= classes[i - 1]))
+	    {
+	      fprintf(stderr, "classes must be ascending multiples of %d of at least %d bytes\n",
+		      GRAIN, MINCLASS);
+	      exit(1);
+	    }
+	}
+      if (classes[n - 1] != pageSize)
+	{
+	  fprintf(stderr, "the largest class must be the page size, %ld\n", pageSize);
+	  exit(1);
+	}
+    }
+
+  for (c = 32; c < pageSize && np < MAXCLASSES - 1; c *= 2)
+    pow2[np++] = c;
+  pow2[np++] = pageSize;
+
+  for (i = 1; i <= gGrains; i++)
+    requests += gGrainCount[i];
+  if (requests == 0)
+    requests = 1;
+
+  printf("Size classes:");
+  for (i = 0; i < n; i++)
+    printf(" %d", classes[i]);
+  printf("\nExpected waste per request: %.1f bytes, %.1f with the powers of two\n",
+	 waste(classes, n, pageSize) / requests, waste(pow2, np, pageSize) / requests);
+
+  writeClasses(header, classes, n, pageSize, overhead, source);
+}
+
+// the share of the page tail no buffer of class size c fits into
+static double
+tail(long c, long pageSize)
+{
+  return (double) (pageSize % c) / (pageSize / c);
+}
+
+// total waste of the counted requests with the given classes
+static double
+waste(int* classes, int n, long pageSize)
+{
+  long g;
+  int j = 0;
+  double sum = 0;
+
+  for (g = 1; g <= gGrains; g++)
+    {
+      while (classes[j] < g * GRAIN)
+	j++;
+      sum += gGrainCount[g] * (classes[j] + tail(classes[j], pageSize)) - gGrainBytes[g];
+    }
+  return sum;
+}
+
+/*  Dynamic program over the grains: best[k][j] is the least waste of
+ *  the requests up to grain j with k classes, the largest of which is
+ *  j * GRAIN. A class at j serves the grains above the previous class,
+ *  so with prefix sums its cost is O(1) and the table takes O(N * G^2)
+ *  for G grains. The page sized class is always taken; fewer than N
+ *  classes, but never fewer than 2, are returned when more do not
+ *  reduce the waste, as the engines keep one class for the page.
+ */
+static int
+optimize(int numClasses, long pageSize, int* classes)
+{
+  long g, i, j, lo = MINCLASS / GRAIN;
+  int k, n, bestK = 2;
+  double *best, cost, c;
+  long *from;
+  long long *count, *bytes;
+
+  best = malloc((numClasses + 1) * (gGrains + 1) * sizeof(double));
+  from = malloc((numClasses + 1) * (gGrains + 1) * sizeof(long));
+  count = calloc(gGrains + 1, sizeof(long long));
+  bytes = calloc(gGrains + 1, sizeof(long long));
+  if (best == NULL || from == NULL || count == NULL || bytes == NULL)
+    {
+      perror("malloc");
+      exit(1);
+    }
+
+  for (g = 1; g <= gGrains; g++)
+    {
+      count[g] = count[g - 1] + gGrainCount[g];
+      bytes[g] = bytes[g - 1] + gGrainBytes[g];
+    }
+
+#define BEST(k, j) best[(k) * (gGrains + 1) + (j)]
+#define FROM(k, j) from[(k) * (gGrains + 1) + (j)]
+  for (j = 0; j <= gGrains; j++)
+    BEST(0, j) = j == 0 ? 0 : HUGE_VAL;
+  for (k = 1; k <= numClasses; k++)
+    {
+      BEST(k, 0) = HUGE_VAL;
+      for (j = 1; j <= gGrains; j++)
+	{
+	  BEST(k, j) = HUGE_VAL;
+	  if (j < lo)
+	    continue;
+	  c = j * GRAIN + tail(j * GRAIN, pageSize);
+	  for (i = 0; i < j; i++)
+	    {
+	      if ((i > 0 && i < lo) || BEST(k - 1, i) == HUGE_VAL)
+		continue;
+	      cost = BEST(k - 1, i) + (count[j] - count[i]) * c - (bytes[j] - bytes[i]);
+	      if (cost < BEST(k, j))
+		{
+		  BEST(k, j) = cost;
+		  FROM(k, j) = i;
+		}
+	    }
+	}
+      if (k > bestK && BEST(k, gGrains) < BEST(bestK, gGrains))
+	bestK = k;
+    }
+
+  for (n = bestK, j = gGrains; n > 0; n--)
+    {
+      classes[n - 1] = j * GRAIN;
+      j = FROM(n, j);
+    }
+#undef BEST
+#undef FROM
+
+  free(best);
+  free(from);
+  free(count);
+  free(bytes);
+  return bestK;
+}
+
+static void
+writeClasses(char* header, int* classes, int n, long pageSize, long overhead,
+	     char* source)
+{
+  int i, j = 0;
+  long g;
+  FILE* out = fopen(header, "w");
+
+  if (out == NULL)
+    {
+      perror(header);
+      exit(1);
+    }
+
+  fprintf(out, "/***************************************************************************\n"
+	  " *  Title: Kernel Memory Allocator\n"
+	  " * -------------------------------------------------------------------------\n"
+	  " *    Purpose: Size classes of the segregated engines (kma_p2fl, kma_mck2)\n"
+	  " *    Author: Stefan Birrer\n"
+	  " *    Copyright: 2004 Northwestern University\n"
+	  " ***************************************************************************/\n"
+	  "/***************************************************************************\n"
+	  " *  Generated by testsuite/traceprof from %s\n"
+	  " *  with %ld bytes of header per request, see \"make classes\".\n"
+	  " ***************************************************************************/\n\n",
+	  source, overhead);
+  fprintf(out, "#ifndef __KMA_CLASSES_H__\n#define __KMA_CLASSES_H__\n\n");
+  fprintf(out, "#if PAGESIZE != %ld\n#error \"size classes generated for %ld byte pages\"\n#endif\n\n",
+	  pageSize, pageSize);
+  fprintf(out, "#define KMA_CLASSES %d\n\n#define KMA_CLASSGRAIN %d\n\n", n, GRAIN);
+
+  fprintf(out, "// initializer of the class sizes, kClassSizes[KMA_CLASSES] in the engines\n");
+  fprintf(out, "#define KMA_CLASS_SIZES {");
+  for (i = 0; i < n; i++)
+    fprintf(out, "%s%s%d", i == 0 ? "" : ",", i % 8 == 0 ? " \\\n  " : " ", classes[i]);
+  fprintf(out, " \\\n}\n\n");
+
+  fprintf(out, "// initializer of the class of a request, kClassOf[PAGESIZE / KMA_CLASSGRAIN + 1]\n"
+	  "// indexed by (size + KMA_CLASSGRAIN - 1) / KMA_CLASSGRAIN\n");
+  fprintf(out, "#define KMA_CLASS_OF {");
+  for (g = 0; g <= gGrains; g++)
+    {
+      while (classes[j] < g * GRAIN)
+	j++;
+      fprintf(out, "%s%s%d", g == 0 ? "" : ",", g % 16 == 0 ? " \\\n  " : " ", j);
+    }
+  fprintf(out, " \\\n}\n\n#endif\n");
+
+  if (fclose(out) != 0)
+    {
+      perror(header);
+      exit(1);
+    }
+  printf("Wrote %d classes to %s\n", n, header);
+}